@@ -0,0 +1,150 @@
+#define NN_IMPLEMENTATION
+#include "../neural_net.h"
+#include <string.h>
+
+// Kernel microbenchmark: the matrix kernels of neural_net.h one by one, on shapes that fit in
+// L1, in L2 and in neither, so a change to one of them (NN_GEMM_* blocking, the SIMD path,
+// -march, NN_CBLAS) is measured on its own instead of through a whole training step. Every row
+// is the best of five runs of a repeat count calibrated to about 20ms. Products report
+// GFLOP/s (2*m*k*n per call), elementwise kernels Gelem/s of dst.
+//
+// usage: kernel_bench [prefix]   only the kernels whose name starts with prefix
+
+typedef enum {
+  K_DOT,     // dst(m x n) += a(m x k) * b(k x n)
+  K_DOT_AT,  // dst(m x n) += a(k x m)^T * b(k x n)
+  K_DOT_BT,  // dst(m x n) += a(m x k) * b(n x k)^T
+  K_DENSE,   // dst(m x n) = act(a(m x k) * b(k x n) + bias)
+  K_SUM,     // dst(m x n) += a, a is m x n, or a single row when k == 1
+  K_SIG,     // dst = sig(dst)
+  K_ACT,     // dst = act(dst)
+  K_NN_SUM,  // nn_sum over dst
+} Kind;
+
+typedef struct {
+  const char *name;
+  Kind kind;
+  size_t m, k, n;
+  NN_Act act;
+} Kernel;
+
+typedef struct {
+  const Kernel *kernel;
+  Mat dst, a, b, bias;
+} Args;
+
+static volatile float sink;
+
+static void call(const Args *x)
+{
+  switch (x->kernel->kind) {
+  case K_DOT:    mat_dot(x->dst, x->a, x->b); break;
+  case K_DOT_AT: mat_dot_at(x->dst, x->a, x->b); break;
+  case K_DOT_BT: mat_dot_bt(x->dst, x->a, x->b); break;
+  case K_DENSE:  mat_dense_act(x->dst, x->a, x->b, x->bias, x->kernel->act); break;
+  case K_SUM:    mat_sum(x->dst, x->a); break;
+  case K_SIG:    mat_sig(x->dst); break;
+  case K_ACT:    mat_act(x->dst, x->kernel->act); break;
+  case K_NN_SUM: sink = nn_sum(x->dst.es, x->dst.rows*x->dst.cols); break;
+  }
+}
+
+static double ns_per_call(const Args *x)
+{
+  size_t reps = 1;
+  for (;;) { // Calibration, doubling as warm-up
+    uint64_t t0 = nn_clock_ns();
+    for (size_t i = 0; i < reps; ++i) call(x);
+    if (nn_clock_ns() - t0 >= 20*1000*1000) break;
+    reps *= 2;
+  }
+
+  double best = 0;
+  for (int run = 0; run < 5; ++run) {
+    uint64_t t0 = nn_clock_ns();
+    for (size_t i = 0; i < reps; ++i) call(x);
+    double ns = (double)(nn_clock_ns() - t0)/(double)reps;
+    if (run == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+
+static void run(const Kernel *kernel)
+{
+  NN_Rng rng = nn_rng_seed(42, 0);
+  size_t m = kernel->m, k = kernel->k, n = kernel->n;
+  int product = kernel->kind <= K_DENSE;
+  Args x = { .kernel = kernel };
+
+  x.dst = mat_alloc(m, n);
+  mat_rand(x.dst, &rng, 0.f, 1.f);
+  if (product) {
+    x.a = kernel->kind == K_DOT_AT ? mat_alloc(k, m) : mat_alloc(m, k);
+    x.b = kernel->kind == K_DOT_BT ? mat_alloc(n, k) : mat_alloc(k, n);
+    x.bias = mat_alloc(1, n);
+    // Small values, so the accumulating kernels stay far from overflow over millions of calls
+    mat_rand(x.a, &rng, -1e-3f, 1e-3f);
+    mat_rand(x.b, &rng, -1e-3f, 1e-3f);
+    mat_rand(x.bias, &rng, -1.f, 1.f);
+  } else if (kernel->kind == K_SUM) {
+    x.a = mat_alloc(k == 1 ? 1 : m, n);
+    mat_rand(x.a, &rng, -1e-3f, 1e-3f);
+  }
+
+  double ns = ns_per_call(&x);
+  double work = product ? 2.0*(double)m*(double)k*(double)n : (double)m*(double)n;
+  char shape[32];
+  if (product) snprintf(shape, sizeof(shape), "%zux%zux%zu", m, k, n);
+  else snprintf(shape, sizeof(shape), "%zux%zu%s", m, n, kernel->kind == K_SUM && k == 1 ? "+row" : "");
+  printf("%-14s %-16s %14.1f %10.2f %s\n", kernel->name, shape, ns, work/ns, product ? "GFLOP/s" : "Gelem/s");
+
+  mat_free(&x.dst);
+  if (x.a.es) mat_free(&x.a);
+  if (x.b.es) mat_free(&x.b);
+  if (x.bias.es) mat_free(&x.bias);
+}
+
+int main(int argc, char **argv)
+{
+  const char *prefix = argc > 1 ? argv[1] : "";
+
+  // The mat_* entry points allocate their GEMM packing space per call (training passes NN.pack
+  // instead); take it from a pool so the rows time the kernels rather than malloc
+  NN_MemPool mem = {0};
+  NN_Allocator pool = nn_mempool_allocator(&mem);
+  nn_allocator_use(&pool);
+
+  Kernel kernels[] = {
+    { "mat_dot",        K_DOT,       16,    16,    16, NN_ACT_NONE },
+    { "mat_dot",        K_DOT,       64,    64,    64, NN_ACT_NONE },
+    { "mat_dot",        K_DOT,      256,   256,   256, NN_ACT_NONE },
+    { "mat_dot",        K_DOT,      512,   512,   512, NN_ACT_NONE },
+    { "mat_dot",        K_DOT,     1024,     2,   256, NN_ACT_NONE }, // First layer of the bench nets
+    { "mat_dot_at",     K_DOT_AT,   256,  1024,   256, NN_ACT_NONE }, // Weight gradient
+    { "mat_dot_bt",     K_DOT_BT,  1024,   256,   256, NN_ACT_NONE }, // Delta of the layer below
+    { "mat_dense:sig",  K_DENSE,   1024,   256,   256, NN_ACT_SIG },
+    { "mat_dense:relu", K_DENSE,   1024,   256,   256, NN_ACT_RELU },
+    { "mat_sum",        K_SUM,       64,    64,    64, NN_ACT_NONE },
+    { "mat_sum",        K_SUM,     1024,  1024,  1024, NN_ACT_NONE },
+    { "mat_sum",        K_SUM,     1024,     1,   256, NN_ACT_NONE }, // Bias broadcast
+    { "mat_sig",        K_SIG,       64,     0,    64, NN_ACT_SIG },
+    { "mat_sig",        K_SIG,      256,     0,   256, NN_ACT_SIG },
+    { "mat_sig",        K_SIG,     1024,     0,  1024, NN_ACT_SIG },
+    { "mat_act:relu",   K_ACT,     1024,     0,  1024, NN_ACT_RELU },
+    { "mat_act:tanh",   K_ACT,     1024,     0,  1024, NN_ACT_TANH },
+    { "mat_act:tanhf",  K_ACT,     1024,     0,  1024, NN_ACT_TANH_FAST },
+    { "mat_act:gelu",   K_ACT,     1024,     0,  1024, NN_ACT_GELU },
+    { "nn_sum",         K_NN_SUM,    64,     0,    64, NN_ACT_NONE },
+    { "nn_sum",         K_NN_SUM,  1024,     0,  1024, NN_ACT_NONE },
+  };
+
+  printf("SIMD width %d, GEMM tile %dx%d\n", NN_SIMD_W, NN_GEMM_MR, NN_GEMM_NR);
+  printf("%-14s %-16s %14s %10s\n", "kernel", "shape", "ns/call", "rate");
+  for (size_t i = 0; i < ARRAY_LEN(kernels); ++i) {
+    if (strncmp(kernels[i].name, prefix, strlen(prefix)) == 0) run(&kernels[i]);
+  }
+
+  nn_allocator_use(NULL);
+  nn_mempool_destroy(&mem);
+  return 0;
+}
@@ -0,0 +1,278 @@
+#define NN_IMPLEMENTATION
+#include "../neural_net.h"
+#include <string.h>
+
+// Training benchmark: the 100k-step XOR workload of the drivers, then the same loop on
+// wider networks over synthetic XOR-like data, reporting the time per step and how it
+// splits between the forward pass (cost), the gradient (backprop) and the update (learn).
+// The xor-fixed row runs the XOR workload on the compile-time specialised NN_FIXED model,
+// xor-pop64 a population of 64 models and 16x16-hogw asynchronous minibatch SGD. The serve
+// rows time inference requests one by one and batched by NN_Server.
+//
+// usage: xor_bench [threads]
+
+typedef struct {
+  const char *name;
+  size_t arch[4];
+  size_t arch_count;
+  size_t rows;    // training rows, all in one batch
+  size_t steps;
+  NN_OptKind opt;
+  float rate;
+  NN_Act act;     // hidden layers, the output stays sigmoid
+} Bench;
+
+float td[] = {
+  0, 0, 0,
+  0, 1, 1,
+  1, 0, 1,
+  1, 1, 0
+};
+
+// Rows of (x0, x1, y) with y = x0 XOR x1 on thresholded uniform inputs
+static Mat synth_xor(NN_Rng *rng, size_t rows)
+{
+  Mat d = mat_alloc(rows, 3);
+  mat_rand(d, rng, 0.f, 1.f);
+  for (size_t i = 0; i < rows; ++i) {
+    int a = MAT_AT(d, i, 0) > 0.5f;
+    int b = MAT_AT(d, i, 1) > 0.5f;
+    MAT_AT(d, i, 2) = (float)(a ^ b);
+  }
+  return d;
+}
+
+static void run(const Bench *b, size_t threads)
+{
+  NN_Rng rng = nn_rng_seed(42, 0); // Fixed seed so runs are comparable across versions
+  Mat d;
+  if (b->rows == 4) {
+    d = (Mat){ .rows = 4, .cols = 3, .stride = 3, .es = td };
+  } else {
+    d = synth_xor(&rng, b->rows);
+  }
+  Mat ti = { .rows = d.rows, .cols = 2, .stride = d.stride, .es = d.es };
+  Mat to = { .rows = d.rows, .cols = 1, .stride = d.stride, .es = d.es + 2 };
+
+  NN m = nn_alloc((size_t*)b->arch, b->arch_count, b->rows);
+  NN g = nn_alloc_grad(m);
+  nn_xavier_init(m, &rng);
+  nn_set_act(m, b->act, NN_ACT_SIG);
+
+  NN_Pool *pool = nn_pool_create(threads);
+  NN_Workers w = nn_workers_alloc(pool, m);
+  NN_Opt opt = nn_opt_alloc(m, b->opt, b->rate);
+
+  uint64_t t_fwd = 0, t_grad = 0, t_upd = 0;
+  uint64_t start = nn_clock_ns();
+  for (size_t i = 0; i < b->steps; ++i) {
+    uint64_t t0 = nn_clock_ns();
+    if (threads > 1) nn_backprop_parallel(w, m, g, ti, to);
+    else nn_backprop(m, g, ti, to);
+    uint64_t t1 = nn_clock_ns();
+    nn_opt_step(&opt, m, g);
+    uint64_t t2 = nn_clock_ns();
+    if (threads > 1) nn_cost_parallel(w, m, ti, to);
+    else nn_cost(m, ti, to);
+    uint64_t t3 = nn_clock_ns();
+
+    t_grad += t1 - t0;
+    t_upd += t2 - t1;
+    t_fwd += t3 - t2;
+  }
+  uint64_t total = nn_clock_ns() - start;
+  float c = nn_cost(m, ti, to);
+
+  double ns_step = (double)total/(double)b->steps;
+  double samples = (double)b->rows*(double)b->steps/((double)total*1e-9);
+  printf("%-12s %7zu %9zu %9zu %12.1f %12.3e %6.1f%% %6.1f%% %6.1f%% %9.6f\n",
+         b->name, m.ps_count, b->rows, b->steps, ns_step, samples,
+         100.0*(double)t_fwd/(double)total,
+         100.0*(double)t_grad/(double)total,
+         100.0*(double)t_upd/(double)total, c);
+
+  nn_opt_free(&opt);
+  nn_workers_free(&w);
+  nn_pool_free(pool);
+  nn_free(&m);
+  nn_free(&g);
+  if (d.es != td) mat_free(&d);
+}
+
+NN_FIXED(Xor221, 2, 2, 1, NN_ACT_SIG, NN_ACT_SIG)
+
+static void run_fixed(size_t steps)
+{
+  NN_Rng rng = nn_rng_seed(42, 0);
+  Mat ti = { .rows = 4, .cols = 2, .stride = 3, .es = td };
+  Mat to = { .rows = 4, .cols = 1, .stride = 3, .es = td + 2 };
+
+  size_t arch[] = {2, 2, 1};
+  NN init = nn_alloc(arch, ARRAY_LEN(arch), 4);
+  nn_xavier_init(init, &rng); // Same start as the xor row
+  Xor221 m, g;
+  Xor221_from_nn(&m, init);
+  nn_free(&init);
+
+  uint64_t t_fwd = 0, t_grad = 0, t_upd = 0;
+  volatile float sink = 0;
+  uint64_t start = nn_clock_ns();
+  for (size_t i = 0; i < steps; ++i) {
+    uint64_t t0 = nn_clock_ns();
+    Xor221_backprop(&m, &g, ti, to);
+    uint64_t t1 = nn_clock_ns();
+    Xor221_learn(&m, &g, 1e-1f);
+    uint64_t t2 = nn_clock_ns();
+    sink = Xor221_cost(&m, ti, to);
+    uint64_t t3 = nn_clock_ns();
+
+    t_grad += t1 - t0;
+    t_upd += t2 - t1;
+    t_fwd += t3 - t2;
+  }
+  uint64_t total = nn_clock_ns() - start;
+  (void) sink;
+
+  printf("%-12s %7zu %9d %9zu %12.1f %12.3e %6.1f%% %6.1f%% %6.1f%% %9.6f\n",
+         "xor-fixed", sizeof(m)/sizeof(float), 4, steps, (double)total/(double)steps,
+         4.0*(double)steps/((double)total*1e-9),
+         100.0*(double)t_fwd/(double)total,
+         100.0*(double)t_grad/(double)total,
+         100.0*(double)t_upd/(double)total, Xor221_cost(&m, ti, to));
+}
+
+// Hogwild SGD on the 16x16 data: minibatches of 16 rows per update, every thread writing into
+// the shared parameters. steps and ns/step count the updates of all threads together.
+static void run_hogwild(size_t steps, size_t threads)
+{
+  NN_Rng rng = nn_rng_seed(42, 0);
+  Mat d = synth_xor(&rng, 256);
+  Mat ti = { .rows = d.rows, .cols = 2, .stride = d.stride, .es = d.es };
+  Mat to = { .rows = d.rows, .cols = 1, .stride = d.stride, .es = d.es + 2 };
+
+  size_t arch[] = {2, 16, 16, 1};
+  NN m = nn_alloc(arch, ARRAY_LEN(arch), 16);
+  nn_xavier_init(m, &rng);
+  NN_Pool *pool = nn_pool_create(threads);
+  NN_Workers w = nn_workers_alloc(pool, m);
+
+  uint64_t start = nn_clock_ns();
+  nn_hogwild(w, m, ti, to, 1e-1f, steps/threads);
+  uint64_t total = nn_clock_ns() - start;
+  size_t updates = steps/threads*threads;
+
+  printf("%-12s %7zu %9d %9zu %12.1f %12.3e %7s %7s %7s %9.6f\n",
+         "16x16-hogw", m.ps_count, 16, updates, (double)total/(double)updates,
+         16.0*(double)updates/((double)total*1e-9), "-", "-", "-", nn_cost(m, ti, to));
+
+  nn_workers_free(&w);
+  nn_pool_free(pool);
+  nn_free(&m);
+  mat_free(&d);
+}
+
+// Serving {2, 256, 256, 1}: one nn_infer per single-row request, then the same requests through
+// an NN_Server that batches up to 64 of them within 50us. steps counts requests.
+static void run_serve(size_t requests)
+{
+  NN_Rng rng = nn_rng_seed(42, 0);
+  Mat d = synth_xor(&rng, 1024);
+  size_t arch[] = {2, 256, 256, 1};
+  NN m = nn_alloc(arch, ARRAY_LEN(arch), 1);
+  nn_xavier_init(m, &rng);
+  float *out = NN_MALLOC(sizeof(float)*d.rows);
+  NN_Request *reqs = NN_MALLOC(sizeof(NN_Request)*d.rows);
+
+  NN_Workspace ws = nn_workspace_alloc(&m, 1);
+  uint64_t start = nn_clock_ns();
+  for (size_t i = 0; i < requests; ++i) {
+    size_t k = i % d.rows;
+    nn_infer(&m, ws, mat_cols(mat_row(d, k), 0, 2), (Mat){ .rows = 1, .cols = 1, .stride = 1, .es = out + k });
+  }
+  uint64_t total = nn_clock_ns() - start;
+  nn_workspace_free(&ws);
+  printf("%-12s %7zu %9d %9zu %12.1f %12.3e %7s %7s %7s %9s\n",
+         "256-infer1", m.ps_count, 1, requests, (double)total/(double)requests,
+         (double)requests/((double)total*1e-9), "-", "-", "-", "-");
+
+  // Up to a queue's worth in flight, all waited for before the next round
+  NN_Server *srv = nn_server_create(&m, 1, 64, d.rows, 50*1000);
+  start = nn_clock_ns();
+  for (size_t i = 0; i < requests; i += d.rows) {
+    size_t r = requests - i < d.rows ? requests - i : d.rows;
+    for (size_t k = 0; k < r; ++k) {
+      reqs[k] = (NN_Request){ .in = &MAT_AT(d, k, 0), .out = out + k };
+      while (nn_server_submit(srv, &reqs[k]) != 0) {}
+    }
+    for (size_t k = 0; k < r; ++k) nn_request_wait(&reqs[k]);
+  }
+  total = nn_clock_ns() - start;
+  nn_server_free(srv);
+  printf("%-12s %7zu %9d %9zu %12.1f %12.3e %7s %7s %7s %9s\n",
+         "256-serve", m.ps_count, 64, requests, (double)total/(double)requests,
+         (double)requests/((double)total*1e-9), "-", "-", "-", "-");
+
+  NN_FREE(reqs);
+  NN_FREE(out);
+  nn_free(&m);
+  mat_free(&d);
+}
+
+// 64 XOR models with different seeds and learning rates trained in lockstep, the best one
+// reported. samples/s counts every model.
+static void run_pop(size_t steps, size_t threads)
+{
+  Mat ti = { .rows = 4, .cols = 2, .stride = 3, .es = td };
+  Mat to = { .rows = 4, .cols = 1, .stride = 3, .es = td + 2 };
+
+  size_t arch[] = {2, 2, 1};
+  NN_Pop pop = nn_pop_alloc(arch, ARRAY_LEN(arch), 64);
+  nn_pop_init(pop, 42);
+  for (size_t k = 0; k < pop.lanes; ++k) {
+    pop.rates[k] = 1e-1f*(1.f + (float)(k % 8)); // 0.1 .. 0.8
+  }
+  NN_Pool *pool = nn_pool_create(threads);
+
+  uint64_t start = nn_clock_ns();
+  nn_pop_train(pool, pop, ti, to, steps);
+  uint64_t total = nn_clock_ns() - start;
+  float c;
+  nn_pop_best(pool, pop, ti, to, &c);
+
+  printf("%-12s %7zu %9d %9zu %12.1f %12.3e %7s %7s %7s %9.6f\n",
+         "xor-pop64", pop.ps_count*pop.models, 4, steps, (double)total/(double)steps,
+         4.0*(double)pop.models*(double)steps/((double)total*1e-9), "-", "-", "-", c);
+
+  nn_pool_free(pool);
+  nn_pop_free(&pop);
+}
+
+int main(int argc, char **argv)
+{
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+  if (threads == 0) threads = 1;
+
+  Bench benches[] = {
+    { "xor",          {2, 2, 1},          3,     4,  100*1000, NN_OPT_SGD,       1e-1f,  NN_ACT_SIG },
+    { "xor-mom",      {2, 2, 1},          3,     4,   10*1000, NN_OPT_NESTEROV,  1e-1f,  NN_ACT_SIG },
+    { "16x16",        {2, 16, 16, 1},     4,   256,    2*1000, NN_OPT_SGD,       1e-1f,  NN_ACT_SIG },
+    { "16x16-adam",   {2, 16, 16, 1},     4,   256,    2*1000, NN_OPT_ADAM,      1e-2f,  NN_ACT_SIG },
+    { "64x64",        {2, 64, 64, 1},     4,  1024,       200, NN_OPT_SGD,       1e-1f,  NN_ACT_SIG },
+    { "64x64-relu",   {2, 64, 64, 1},     4,  1024,       200, NN_OPT_SGD,       1e-1f,  NN_ACT_RELU },
+    { "64x64-tanhf",  {2, 64, 64, 1},     4,  1024,       200, NN_OPT_SGD,       1e-1f,  NN_ACT_TANH_FAST },
+    { "256x256",      {2, 256, 256, 1},   4,  1024,        50, NN_OPT_SGD,       1e-1f,  NN_ACT_SIG },
+  };
+
+  printf("threads %zu, SIMD width %d\n", threads, NN_SIMD_W);
+  printf("%-12s %7s %9s %9s %12s %12s %7s %7s %7s %9s\n",
+         "bench", "params", "rows", "steps", "ns/step", "samples/s", "fwd", "grad", "update", "cost");
+  for (size_t i = 0; i < ARRAY_LEN(benches); ++i) {
+    run(&benches[i], threads);
+    if (i == 0) run_fixed(benches[i].steps);
+    if (i == 0) run_pop(benches[i].steps/10, threads);
+    if (i == 3) run_hogwild(32*1000, threads);
+    if (i == ARRAY_LEN(benches) - 1) run_serve(8*1024);
+  }
+
+  return 0;
+}
@@ -1,7 +1,16 @@
 #ifndef NN_H_ // Header section begins
 #define  NN_H_
 
+// The implementation uses POSIX (clock_gettime, nanosleep, pthreads, mmap), which strict
+// -std=c11 hides. The feature macro has to precede every system header, so include
+// neural_net.h first in the translation unit that defines NN_IMPLEMENTATION, or define
+// _POSIX_C_SOURCE on the command line.
+#if defined(NN_IMPLEMENTATION) && !defined(_POSIX_C_SOURCE) && !defined(_WIN32)
+#define  _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <math.h>
 
@@ -10,11 +19,106 @@
 #define  NN_MALLOC malloc
 #endif // NN_MALLOC
 
+#ifndef NN_FREE
+#include <stdlib.h>
+#define  NN_FREE free
+#endif // NN_FREE
+
+// Alignment of every block from nn_mem_alloc, and so of every Mat, NN and workspace
+#ifndef NN_ALIGN
+#define  NN_ALIGN 64
+#endif // NN_ALIGN
+
 #ifndef NN_ASSERT
 #include <assert.h>
 #define  NN_ASSERT assert
 #endif // NN_ASSERT
 
+// Blocking of the mat_dot GEMM kernel, see mat_gemm. MR x NR is the register tile: MR rows of
+// NR/NN_GEMM_VW vectors, sized so the accumulators fit in the vector registers of the target.
+// KC x NC panels of b and MC x KC blocks of a are sized for L1/L2.
+#ifndef NN_GEMM_VW
+#if defined(__AVX512F__)
+#define  NN_GEMM_VW 16
+#elif defined(__AVX__)
+#define  NN_GEMM_VW 8
+#else
+#define  NN_GEMM_VW 4
+#endif
+#endif // NN_GEMM_VW
+
+#ifndef NN_GEMM_MR
+#define  NN_GEMM_MR 6
+#define  NN_GEMM_NR (2*NN_GEMM_VW)
+#endif // NN_GEMM_MR
+
+#ifndef NN_GEMM_KC
+#define  NN_GEMM_KC 256
+#define  NN_GEMM_MC 96
+#define  NN_GEMM_NC 2048
+#endif // NN_GEMM_KC
+
+#ifndef NN_GEMM_SMALL
+#define  NN_GEMM_SMALL (32*32*32)
+#endif // NN_GEMM_SMALL
+
+// Products above NN_GEMM_SMALL go to a system BLAS instead of mat_gemm when NN_SGEMM is set:
+// build with -DNN_CBLAS and link OpenBLAS/MKL (-lopenblas), or define NN_SGEMM to any function
+// with the cblas_sgemm signature after including its header (Accelerate: cblas_sgemm from
+// <Accelerate/Accelerate.h>). The built-in kernel stays the default.
+#if defined(NN_CBLAS) && !defined(NN_SGEMM)
+#include <cblas.h>
+#define  NN_SGEMM cblas_sgemm
+#endif // NN_CBLAS
+
+#ifndef NN_LRELU_ALPHA
+#define  NN_LRELU_ALPHA 0.01f
+#endif // NN_LRELU_ALPHA
+
+// Every allocation of the library goes through nn_mem_alloc / nn_mem_free, which use the
+// calling thread's current allocator (nn_allocator_use, the system one by default) and
+// return NN_ALIGN-aligned blocks. Each block remembers its allocator, so it can be freed
+// from any thread and under any current allocator; the allocator must outlive its blocks.
+// alloc returns blocks aligned to at least align (padded up to NN_ALIGN otherwise) or NULL,
+// free gets the size that was asked for.
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *p, size_t size);
+    size_t align;
+    void *ctx;
+} NN_Allocator;
+
+void *nn_mem_alloc(size_t size);
+void nn_mem_free(void *p);
+const NN_Allocator *nn_allocator_use(const NN_Allocator *a); // NULL for the system one; returns the previous
+NN_Allocator nn_system_allocator(void); // NN_MALLOC / NN_FREE
+
+// Bump allocator over one fixed block: frees are no-ops and nn_arena_reset releases everything
+// at once. Out of space, alloc returns NULL. Not thread-safe.
+typedef struct {
+    char *base;
+    size_t size; // of the whole block, alignment slack included
+    size_t used;
+} NN_Arena;
+
+NN_Arena nn_arena_create(size_t size);
+void nn_arena_destroy(NN_Arena *arena);
+void nn_arena_reset(NN_Arena *arena);
+NN_Allocator nn_arena_allocator(NN_Arena *arena);
+
+// Caches freed blocks in power-of-two size classes up to NN_MEMPOOL_MAX bytes, so buffers
+// that are allocated and freed over and over are recycled instead of going back to the
+// system; larger blocks pass straight through. Not thread-safe.
+#define NN_MEMPOOL_CLASSES 20
+#define NN_MEMPOOL_MAX ((size_t)NN_ALIGN << (NN_MEMPOOL_CLASSES - 1))
+
+typedef struct {
+    void *lists[NN_MEMPOOL_CLASSES];
+} NN_MemPool;
+
+void nn_mempool_destroy(NN_MemPool *pool); // returns the cached blocks to the system
+NN_Allocator nn_mempool_allocator(NN_MemPool *pool);
+
 //very lightweight as its 3 64 bit ints
 typedef struct {
     size_t rows;
@@ -25,24 +129,419 @@ typedef struct {
 
 #define MAT_AT(m, i, j) (m).es[(i)*(m).stride + (j)]
 
-float rand_float(void);
-float xavier_init(size_t inputs, size_t outputs);
+uint64_t nn_clock_ns(void); // monotonic clock, for seeding and timing
+
+// Counter-based generator: draw i of a stream is a hash of (key, i). There is no hidden global
+// state, every thread can own a stream, and bulk fills have no loop-carried dependency so
+// they vectorize. Same seed and stream, same numbers, whatever the thread count.
+typedef struct {
+    uint64_t key;
+    uint64_t counter;
+} NN_Rng;
+
+NN_Rng nn_rng_seed(uint64_t seed, uint64_t stream);
+uint32_t nn_rng_u32(NN_Rng *rng);
+void nn_rng_fill(NN_Rng *rng, float *dst, size_t n, float low, float high);
+float rand_float(NN_Rng *rng); // uniform in [0, 1) with 24 bits of resolution
+float xavier_init(NN_Rng *rng, size_t inputs, size_t outputs);
 float sigmoidf(float x);
 
+// Activation of a layer. The _FAST variants replace exp with a [7/6] Pade approximant of tanh
+// (sigmoid(x) = (1 + tanh(x/2))/2), one division and no transcendental call, with an absolute
+// error below 1e-4 for tanh and 5e-5 for sigmoid. GELU is the tanh form,
+// x/2*(1 + tanh(sqrt(2/pi)*(x + 0.044715x^3))). NN_ACT_NONE is the identity.
+typedef enum {
+    NN_ACT_SIG,
+    NN_ACT_TANH,
+    NN_ACT_RELU,
+    NN_ACT_LRELU, // slope NN_LRELU_ALPHA below zero
+    NN_ACT_GELU,
+    NN_ACT_SIG_FAST,
+    NN_ACT_TANH_FAST,
+    NN_ACT_NONE,
+    NN_ACT_COUNT,
+} NN_Act;
+
+float nn_act(NN_Act act, float x);
+
 Mat mat_alloc(size_t rows, size_t cols);
 void mat_free(Mat *m);
 void mat_fill(Mat m, float x);
-void mat_rand(Mat m, float low, float high);
-void mat_xavier_init(Mat m, size_t inputs, size_t outputs);
+void mat_rand(Mat m, NN_Rng *rng, float low, float high);
+void mat_xavier_init(Mat m, NN_Rng *rng, size_t inputs, size_t outputs);
+void mat_shuffle_rows(Mat m, NN_Rng *rng);
 Mat mat_row(Mat m, size_t row);
+Mat mat_rows(Mat m, size_t row, size_t count);
+Mat mat_cols(Mat m, size_t col, size_t count); // View of columns col..col+count, same stride
 void mat_sub(Mat m, size_t);
 void mat_copy(Mat dst, Mat src);
-void mat_dot(Mat dst, Mat a, Mat b); //preallocate memory for the three matrices
-void mat_sum(Mat dst, Mat a);
+void mat_dot(Mat dst, Mat a, Mat b); // dst += a * b, preallocate memory for the three matrices
+void mat_dot_at(Mat dst, Mat a, Mat b); // dst += a^T * b
+void mat_dot_bt(Mat dst, Mat a, Mat b); // dst += a * b^T
+// dst = alpha*op(a)*op(b) + beta*dst, op transposing when ta/tb is set. With beta == 0 dst
+// is only written, never read, so it may hold anything (e.g. fresh mat_alloc memory).
+void mat_dot_ex(Mat dst, Mat a, int ta, Mat b, int tb, float alpha, float beta);
+void mat_sum(Mat dst, Mat a); // a may also be a single row, added to every row of dst
+void mat_dense(Mat dst, Mat x, Mat w, Mat b, float (*act)(float)); // dst = act(x*w + b), act may be NULL
+void mat_dense_sig(Mat dst, Mat x, Mat w, Mat b); // dst = sig(x*w + b)
+void mat_dense_act(Mat dst, Mat x, Mat w, Mat b, NN_Act act); // dst = act(x*w + b), vectorized
 void mat_sig(Mat m);
+void mat_act(Mat m, NN_Act act);
 void mat_print(Mat m, const char *name);
 #define MAT_PRINT(m) mat_print(m, #m)
 
+// Half-precision storage for parameters: bf16 (float with the low 16 mantissa bits dropped,
+// same range) or IEEE fp16 (more precision, range +-65504). Values are rounded to nearest even
+// on the way in and widened to float for every computation, so sums still accumulate in fp32
+// while the weights take half the memory and bandwidth.
+typedef enum {
+    NN_BF16,
+    NN_FP16,
+} NN_Half;
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t stride;
+    NN_Half type;
+    uint16_t *es;
+} Mat16;
+
+uint16_t nn_half_from_float(NN_Half type, float x);
+float nn_half_to_float(NN_Half type, uint16_t h);
+Mat16 mat16_alloc(size_t rows, size_t cols, NN_Half type);
+void mat16_free(Mat16 *m);
+void mat16_from_mat(Mat16 dst, Mat src);
+void mat16_to_mat(Mat dst, Mat16 src);
+// dst += a * b, b widened to float. scratch holds mat_dot16_scratch(dst.rows, dst.cols, a.cols)
+// floats, or is NULL to allocate it per call.
+size_t mat_dot16_scratch(size_t m, size_t n, size_t k);
+void mat_dot16(Mat dst, Mat a, Mat16 b, float *scratch);
+
+#define ARRAY_LEN(xs) sizeof((xs))/sizeof((xs)[0])
+
+// A fully connected network described by an architecture array, e.g. {2, 16, 16, 1}.
+// Layer i maps as[i] to as[i+1] through ws[i] and bs[i], so there are count+1 activations.
+// Activations are batch x width: one row per sample of the batch the NN was allocated for.
+// Everything lives in one arena allocation; the parameters ws[0], bs[0], ws[1], ... are laid
+// out back to back so ps spans all of them as one flat vector. acts[i] is the activation of
+// layer i, sigmoid everywhere after nn_alloc. With batch 0 the NN holds parameters only: the
+// as headers keep the widths but have no rows, which is all a gradient (nn_alloc_grad), a
+// model that only serves through nn_infer, or one of many stored models needs.
+typedef struct {
+    size_t count;
+    Mat *ws;
+    Mat *bs;
+    Mat *as;
+    float *ds;   // batch x widest layer, the deltas between two layers in nn_backprop
+    float *pack; // GEMM packing space of the forward and backward products at nn's batch size
+    NN_Act *acts;
+    float *ps;
+    size_t ps_count;
+    void *arena; // nn_mem_alloc'd block backing all of the above, NULL if the NN does not own it;
+                 // after nn_load the parameters live in the file mapping instead
+} NN;
+
+#define NN_INPUT(nn) (nn).as[0]
+#define NN_OUTPUT(nn) (nn).as[(nn).count]
+
+NN nn_alloc(size_t *arch, size_t arch_count, size_t batch);
+NN nn_alloc_like(NN nn); // same architecture and batch size
+NN nn_alloc_grad(NN nn); // same architecture, parameters only
+void nn_free(NN *nn);
+void nn_set_act(NN nn, NN_Act hidden, NN_Act output);
+void nn_zero(NN nn);
+void nn_xavier_init(NN nn, NN_Rng *rng);
+void nn_print(NN nn, const char *name);
+#define NN_PRINT(nn) nn_print(nn, #nn)
+void nn_forward(NN nn);
+void nn_forward_batch(NN nn, Mat x);
+// Re-evaluates layers layer.. of the slice x from the activations nn.as[layer] cached by the
+// last forward pass over x: after a change to the parameters of that layer (nn_param_layer),
+// the layers below it need no recomputation. Perturbation loops that go top-down, last layer
+// first, never start from a stale cache.
+void nn_forward_from(NN nn, Mat x, size_t layer);
+size_t nn_param_layer(NN nn, size_t p); // layer whose weights or biases hold nn.ps[p]
+// Reproducible sums (see NN_SUM_BLOCK): the order of the additions depends on n only, not on
+// the SIMD width or the thread count. nn_dot(x, x, n) is the sum of squares.
+float nn_sum(const float *x, size_t n);
+float nn_dot(const float *a, const float *b, size_t n);
+float nn_cost(NN nn, Mat ti, Mat to);
+void nn_finite_diff(NN nn, NN g, float eps, Mat ti, Mat to);
+float nn_backprop(NN nn, NN g, Mat ti, Mat to); // returns nn_cost, from the same forward pass
+void nn_learn(NN nn, NN g, float rate);
+
+// Optimizers over the flat parameter vector: every step is one fused pass over ps, g.ps and the
+// state buffers (velocity for momentum, first and second moments for Adam), which live in a
+// single allocation of ps_count floats per buffer. nn_opt_alloc fills in the usual defaults
+// (momentum 0.9, Adam betas 0.9/0.999, eps 1e-8); change the fields before the first step.
+typedef enum {
+    NN_OPT_SGD,
+    NN_OPT_MOMENTUM,
+    NN_OPT_NESTEROV,
+    NN_OPT_ADAM,
+} NN_OptKind;
+
+typedef struct {
+    NN_OptKind kind;
+    float rate;
+    float beta1; // momentum, or the Adam first moment decay
+    float beta2;
+    float eps;
+    size_t t;    // steps taken, for the Adam bias correction
+    size_t count;
+    float *m;    // velocity or first moment
+    float *v;    // second moment
+    void *arena;
+} NN_Opt;
+
+NN_Opt nn_opt_alloc(NN nn, NN_OptKind kind, float rate);
+void nn_opt_free(NN_Opt *opt);
+void nn_opt_reset(NN_Opt *opt);
+void nn_opt_step(NN_Opt *opt, NN nn, NN g);
+
+// Caller-owned scratch for nn_infer: two ping-pong buffers of batch x widest hidden layer plus
+// the GEMM packing space, in one allocation. With one workspace per thread, any number of
+// threads can serve from the same read-only NN without allocating.
+typedef struct {
+    size_t batch;
+    float *act[2];
+    float *pack;
+    void *arena;
+} NN_Workspace;
+
+NN_Workspace nn_workspace_alloc(const NN *nn, size_t batch);
+void nn_workspace_free(NN_Workspace *ws);
+void nn_infer(const NN *nn, NN_Workspace ws, Mat x, Mat y);
+
+// Int8 inference model quantized from a trained NN. Every layer stores its weights as int8
+// with one scale (w ~ scale*q, scale = max|w|/127); biases stay float. nn_q8_infer quantizes
+// each input row with its own scale, accumulates the products in int32 and rescales to float
+// before the bias and the activation. A quarter of the fp32 weight footprint; runs on an
+// NN_Workspace from nn_q8_workspace_alloc, released with nn_workspace_free.
+typedef struct {
+    size_t rows;
+    size_t cols;
+    float scale;
+    int8_t *es;
+} MatQ8;
+
+typedef struct {
+    size_t count;
+    MatQ8 *ws;
+    Mat *bs;
+    NN_Act *acts;
+    void *arena;
+} NN_Q8;
+
+NN_Q8 nn_quantize(NN nn);
+void nn_q8_free(NN_Q8 *q);
+NN_Workspace nn_q8_workspace_alloc(const NN_Q8 *q, size_t batch);
+void nn_q8_infer(const NN_Q8 *q, NN_Workspace ws, Mat x, Mat y);
+
+// Binary checkpoints (version 2, native endianness, marker checked on load):
+//
+//     header   magic "NNCKPT\0\0", u32 version, u32 endian marker, u64 layers, u64 ps_count
+//     arch     u64[layers + 1]
+//     mats     {u64 rows, cols, stride, offset}[2*layers], ws[0], bs[0], ws[1], ...
+//     acts     u32[layers], the NN_Act of every layer (not in version 1: all sigmoid)
+//     data     floats at 64-byte aligned offsets, the Mats back to back (stride == cols)
+//
+// nn_load mmaps the file copy-on-write and points Mat.es (and ps) straight into the mapping:
+// no copy, pages shared between processes until written. The NN owns only its headers and
+// activations; release the mapping with nn_unmap after nn_free. Both return 0 or -1.
+typedef struct {
+    void *addr;
+    size_t size;
+} NN_Map;
+
+int nn_save(NN nn, const char *path);
+int nn_load(const char *path, size_t batch, NN *nn, NN_Map *map);
+void nn_unmap(NN_Map *map);
+
+// Streaming training data for datasets that do not fit in memory. Rows of cols floats are read
+// from CSV (values separated by commas or whitespace, an optional non-numeric header line) or
+// from raw native float32 rows, batch rows at a time. A background thread fills one buffer
+// while the caller trains on the other. nn_stream_next points *batch at the next rows (valid
+// until the following call) and returns their count, 0 once at the end of every epoch before
+// the file starts over, or -1 on a read or parse error. Split features and labels with
+// mat_cols, as for any other row-major data. Needs -pthread.
+typedef enum {
+    NN_STREAM_CSV,
+    NN_STREAM_F32,
+} NN_StreamFormat;
+
+typedef struct NN_Stream NN_Stream;
+
+NN_Stream *nn_stream_open(const char *path, NN_StreamFormat format, size_t cols, size_t batch);
+long nn_stream_next(NN_Stream *s, Mat *batch);
+void nn_stream_close(NN_Stream *s);
+
+// Fixed set of threads that all run the same task, the calling thread included as tid 0.
+// nn_pool_run returns once every thread has finished the task. Needs -pthread.
+typedef struct NN_Pool NN_Pool;
+typedef void (*NN_Task)(void *ctx, size_t tid, size_t count);
+
+NN_Pool *nn_pool_create(size_t count);
+void nn_pool_free(NN_Pool *pool);
+size_t nn_pool_count(const NN_Pool *pool);
+void nn_pool_run(NN_Pool *pool, NN_Task task, void *ctx);
+
+// Data-parallel training: the rows are cut into NN_SHARDS fixed shards, and the threads of the
+// pool take turns forwarding shards on their own model replica (own activations, parameters
+// aliased to the trained NN), each shard into its own gradient; the shard gradients are then
+// tree-reduced into g in a fixed pairwise order. Which thread runs which shard does not change
+// the arithmetic, so cost and gradient are bit-identical for any pool size. Threads beyond
+// NN_SHARDS idle, so raise it for larger machines (at one gradient per shard of memory).
+#ifndef NN_SHARDS
+#define  NN_SHARDS 16
+#endif // NN_SHARDS
+
+typedef struct {
+    NN_Pool *pool;
+    NN *ms;        // one replica per thread, activations only, over the trained NN's ps
+    NN *gs;        // one gradient per shard, and at least one per thread (nn_hogwild)
+    float *costs;  // one squared-error sum per shard
+    size_t shards;
+} NN_Workers;
+
+NN_Workers nn_workers_alloc(NN_Pool *pool, NN nn);
+void nn_workers_free(NN_Workers *w);
+float nn_cost_parallel(NN_Workers w, NN nn, Mat ti, Mat to);
+float nn_backprop_parallel(NN_Workers w, NN nn, NN g, Mat ti, Mat to);
+
+// Asynchronous (Hogwild) SGD: every worker cycles through its own share of the rows in
+// minibatches of nn's batch size, and after each one writes rate*gradient straight into nn.ps
+// with relaxed per-float atomics. There is no reduction and no barrier until all workers have
+// done `steps` updates. Workers read parameters while others update them, and updates may be
+// lost to a concurrent write: the usual Hogwild trade, harmless when gradients are sparse or
+// small. Entries with a zero gradient are not written, so dead units cost no cache traffic.
+// Returns the cost of the last minibatch of each worker, averaged over rows.
+float nn_hogwild(NN_Workers w, NN nn, Mat ti, Mat to, float rate, size_t steps);
+
+// Training loop that stops on convergence instead of running a fixed number of steps. The loss
+// is the one nn_backprop returns, so checking it costs no extra forward pass; it is the cost
+// before the step's update. Every `every` steps it is compared with target and with the best
+// loss so far: training stops once it is at most target, or after `patience` evaluations in a
+// row that did not improve by more than the fraction min_delta on the last loss that did (0
+// disables the patience check), or after max_steps. Smaller gains still lower best but do not
+// move that reference, so a loss creeping down a plateau runs out of patience only if it creeps
+// by less than min_delta over the whole window. opt NULL is plain SGD at rate; workers, when not NULL, spread
+// the gradient over their pool.
+typedef enum {
+    NN_STOP_TARGET,
+    NN_STOP_PATIENCE,
+    NN_STOP_MAX_STEPS,
+} NN_StopReason;
+
+typedef struct {
+    size_t max_steps;
+    size_t every;
+    float target;
+    size_t patience;
+    float min_delta;
+    float rate;
+    NN_Opt *opt;
+    NN_Workers *workers;
+} NN_Train;
+
+typedef struct {
+    size_t steps;
+    float loss; // at the last evaluation
+    float best;
+    NN_StopReason reason;
+} NN_TrainResult;
+
+NN_TrainResult nn_train(NN nn, NN g, Mat ti, Mat to, NN_Train cfg);
+
+// Verifies an analytic gradient g of nn_cost against central differences. The parameters are
+// split across the pool and every thread perturbs its own copy of nn, so nn is left untouched.
+// Returns the largest relative error |g - fd| / max(|g|, |fd|) over all parameters, with the
+// denominator floored at 1e-3 of the largest |g| so float noise on near-zero entries is ignored.
+float nn_gradient_check(NN_Pool *pool, NN nn, NN g, Mat ti, Mat to, float eps);
+
+// Population of independent models of one architecture, trained in lockstep for seed and
+// learning rate searches. Parameter p (in NN.ps order) of model k is ps[p*lanes + k], so every
+// step of the forward and backward pass is a SIMD operation across models, and nn_pop_train
+// splits the models across the pool with no synchronisation between steps. lanes is models
+// rounded up to the SIMD width; the padding lanes train too but are never reported. Model k
+// learns with rates[k] (1e-1 after nn_pop_alloc); acts are shared and may be anything but
+// NN_ACT_GELU. Full-batch SGD on ti/to, one row at a time across all the models.
+typedef struct {
+    size_t count;    // layers
+    size_t models;
+    size_t lanes;
+    size_t *arch;    // count + 1 widths
+    NN_Act *acts;
+    size_t ps_count; // per model
+    float *ps;
+    float *rates;
+    void *arena;
+} NN_Pop;
+
+NN_Pop nn_pop_alloc(size_t *arch, size_t arch_count, size_t models);
+void nn_pop_free(NN_Pop *pop);
+void nn_pop_init(NN_Pop pop, uint64_t seed); // Xavier, model k drawn from nn_rng_seed(seed, k)
+void nn_pop_set(NN_Pop pop, size_t k, NN nn); // nn.ps into model k
+void nn_pop_get(NN_Pop pop, size_t k, NN nn); // model k into nn.ps, and the acts into nn.acts
+void nn_pop_train(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, size_t steps);
+void nn_pop_cost(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, float *costs); // models entries
+size_t nn_pop_best(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, float *cost); // lowest-cost model
+
+// Batching inference server. Requests go through a bounded lock-free queue (queue entries,
+// rounded up to a power of two) to `threads` worker threads. A worker takes the first pending
+// request, then keeps collecting until it has batch of them or deadline_ns have passed,
+// runs one nn_infer over the batch and scatters the rows back. The NN is only read, so it
+// must stay alive and unchanged while the server runs. A request is one input row in and
+// one output row out, both caller-owned until nn_request_done returns 1.
+typedef struct NN_Server NN_Server;
+
+typedef struct {
+    const float *in; // input width floats
+    float *out;      // output width floats, written by the server
+    int done;
+} NN_Request;
+
+NN_Server *nn_server_create(const NN *nn, size_t threads, size_t batch, size_t queue, uint64_t deadline_ns);
+void nn_server_free(NN_Server *s); // answers what is already queued, then stops the workers
+int nn_server_submit(NN_Server *s, NN_Request *req); // 0, or -1 when the queue is full
+int nn_request_done(const NN_Request *req);
+void nn_request_wait(const NN_Request *req);
+
+// Opt-in kernel counters: build with -DNN_PROFILE and mat_dot, mat_dot_at, mat_dot_bt,
+// mat_dense, mat_sum, mat_sig, mat_act, mat_copy, nn_backprop, nn_learn and nn_opt_step count
+// their calls, ticks (TSC on x86, the virtual counter on arm64, ns elsewhere; inclusive of the
+// kernels they call) and estimated FLOPs and bytes moved. The counters are shared by all
+// threads and a summary table goes to stderr at exit. Without NN_PROFILE the hooks vanish.
+#ifdef NN_PROFILE
+typedef enum {
+    NN_PROF_DOT,
+    NN_PROF_DOT_AT,
+    NN_PROF_DOT_BT,
+    NN_PROF_DENSE,
+    NN_PROF_SUM,
+    NN_PROF_SIG,
+    NN_PROF_ACT,
+    NN_PROF_COPY,
+    NN_PROF_BACKPROP,
+    NN_PROF_LEARN,
+    NN_PROF_OPT,
+    NN_PROF_COUNT,
+} NN_ProfKernel;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t ticks;
+    uint64_t flops;
+    uint64_t bytes;
+} NN_ProfCounter;
+
+extern NN_ProfCounter nn_prof_counters[NN_PROF_COUNT];
+
+void nn_prof_print(FILE *f);
+void nn_prof_reset(void);
+#endif // NN_PROFILE
+
 
 
 
@@ -50,137 +549,3479 @@ void mat_print(Mat m, const char *name);
 
 #ifdef  NN_IMPLEMENTATION // C Implementation begins
 
-inline float sigmoidf(float x)
+#include <string.h>
+
+#define NN_GELU_K 0.7978845608f // sqrt(2/pi)
+#define NN_GELU_C 0.044715f
+
+#if defined(_MSC_VER)
+#define NN_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define NN_THREAD_LOCAL __thread
+#else
+#define NN_THREAD_LOCAL _Thread_local
+#endif
+
+static void *nn_system_alloc(void *ctx, size_t size)
 {
-    return 1.f / (1.f + expf(-x));
+    (void) ctx;
+    return NN_MALLOC(size);
 }
 
-inline float rand_float(void)
+static void nn_system_free(void *ctx, void *p, size_t size)
 {
-    return (float) rand() / (float) RAND_MAX;
+    (void) ctx;
+    (void) size;
+    NN_FREE(p);
 }
 
-inline float xavier_init(size_t inputs, size_t outputs)
+static const NN_Allocator nn_system_allocator_ = {
+    .alloc = nn_system_alloc, .free = nn_system_free, .align = sizeof(void*)*2,
+};
+static NN_THREAD_LOCAL const NN_Allocator *nn_current_allocator;
+
+inline NN_Allocator nn_system_allocator(void)
 {
-    float limit = sqrt(6.0 / (inputs + outputs));
-    return rand_float() * 2 * limit - limit;
+    return nn_system_allocator_;
 }
 
-inline Mat mat_alloc(size_t rows, size_t cols) // allocate memory for the matrix struct
+inline const NN_Allocator *nn_allocator_use(const NN_Allocator *a)
 {
-    Mat m;
-    m.rows = rows;
-    m.cols = cols;
-    m.stride = cols;
-    m.es = NN_MALLOC(sizeof(*m.es) * rows * cols);
-    NN_ASSERT(m.es != NULL);
-    return m;
+    const NN_Allocator *prev = nn_current_allocator;
+    nn_current_allocator = a;
+    return prev ? prev : &nn_system_allocator_;
 }
 
-inline void mat_free(Mat *m)
+// Sits right before every block: where it came from and what to hand back
+typedef struct {
+    const NN_Allocator *a;
+    void *raw;
+    size_t size;
+} NN_MemHeader;
+
+#define NN_MEM_HEADER ((sizeof(NN_MemHeader) + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN)
+
+inline void *nn_mem_alloc(size_t size)
 {
-    if (m->es) {
-        free(m->es);
-        m->es = NULL;
+    const NN_Allocator *a = nn_current_allocator ? nn_current_allocator : &nn_system_allocator_;
+    if (size > SIZE_MAX - NN_MEM_HEADER - NN_ALIGN) return NULL;
+    size_t total = size + NN_MEM_HEADER + (a->align < NN_ALIGN ? NN_ALIGN - a->align : 0);
+    char *raw = a->alloc(a->ctx, total);
+    if (!raw) return NULL;
+    uintptr_t p = ((uintptr_t)raw + sizeof(NN_MemHeader) + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN;
+    ((NN_MemHeader*)p)[-1] = (NN_MemHeader){ .a = a, .raw = raw, .size = total };
+    return (void*)p;
+}
+
+inline void nn_mem_free(void *p)
+{
+    if (!p) return;
+    NN_MemHeader h = ((NN_MemHeader*)p)[-1];
+    h.a->free(h.a->ctx, h.raw, h.size);
+}
+
+static void *nn_arena_alloc(void *ctx, size_t size)
+{
+    NN_Arena *arena = ctx;
+    size = (size + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN;
+    if (size > arena->size - arena->used) return NULL;
+    void *p = arena->base + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static void nn_arena_free(void *ctx, void *p, size_t size)
+{
+    (void) ctx;
+    (void) p;
+    (void) size;
+}
+
+inline NN_Arena nn_arena_create(size_t size)
+{
+    NN_Arena arena;
+    arena.size = (size + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN + NN_ALIGN; // Room to align the base
+    arena.used = 0;
+    arena.base = nn_system_alloc(NULL, arena.size);
+    NN_ASSERT(arena.base != NULL);
+    nn_arena_reset(&arena);
+    return arena;
+}
+
+inline void nn_arena_destroy(NN_Arena *arena)
+{
+    if (arena->base) {
+        nn_system_free(NULL, arena->base, arena->size);
     }
-    m->rows = m->cols = m->stride = 0;
+    arena->base = NULL;
+    arena->size = arena->used = 0;
 }
 
-inline void mat_fill(Mat m, float x)
+// Starts over from the first NN_ALIGN boundary of the block, whatever NN_MALLOC returned
+inline void nn_arena_reset(NN_Arena *arena)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = x;
-        }
+    uintptr_t b = (uintptr_t)arena->base;
+    arena->used = (size_t)((b + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN - b);
+}
+
+inline NN_Allocator nn_arena_allocator(NN_Arena *arena)
+{
+    return (NN_Allocator){ .alloc = nn_arena_alloc, .free = nn_arena_free, .align = NN_ALIGN, .ctx = arena };
+}
+
+static inline size_t nn_mempool_class(size_t size)
+{
+    size_t c = 0;
+    while (((size_t)NN_ALIGN << c) < size) c += 1;
+    return c;
+}
+
+// Cached blocks are linked through their first word
+static void *nn_mempool_alloc(void *ctx, size_t size)
+{
+    NN_MemPool *pool = ctx;
+    if (size > NN_MEMPOOL_MAX) return NN_MALLOC(size);
+    size_t c = nn_mempool_class(size);
+    void *p = pool->lists[c];
+    if (p) {
+        pool->lists[c] = *(void**)p;
+        return p;
     }
+    return NN_MALLOC((size_t)NN_ALIGN << c);
 }
 
-inline void mat_sum(Mat dst, Mat a)
+static void nn_mempool_free(void *ctx, void *p, size_t size)
 {
-    NN_ASSERT(dst.rows == a.rows);
-    NN_ASSERT(dst.cols == a.cols);
-    for (size_t i = 0; i < dst.rows; ++i){
-        for (size_t j = 0; j < dst.cols; ++j) {
-            MAT_AT(dst, i, j) += MAT_AT(a, i, j);
-        }
+    NN_MemPool *pool = ctx;
+    if (size > NN_MEMPOOL_MAX) {
+        NN_FREE(p);
+        return;
     }
+    size_t c = nn_mempool_class(size);
+    *(void**)p = pool->lists[c];
+    pool->lists[c] = p;
 }
 
-inline void mat_sig(Mat m)
+inline void nn_mempool_destroy(NN_MemPool *pool)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = sigmoidf(MAT_AT(m, i, j));
+    for (size_t c = 0; c < NN_MEMPOOL_CLASSES; ++c) {
+        while (pool->lists[c]) {
+            void *p = pool->lists[c];
+            pool->lists[c] = *(void**)p;
+            NN_FREE(p);
         }
     }
 }
 
-inline void mat_dot(Mat dst, Mat a, Mat b)
+inline NN_Allocator nn_mempool_allocator(NN_MemPool *pool)
 {
-    NN_ASSERT(a.cols == b.rows);
-    size_t n = a.cols;
-    NN_ASSERT(dst.rows == a.rows);
-    NN_ASSERT(dst.cols == b.cols);
+    return (NN_Allocator){
+        .alloc = nn_mempool_alloc, .free = nn_mempool_free, .align = sizeof(void*)*2, .ctx = pool,
+    };
+}
 
-    for (size_t i = 0; i < dst.rows; ++i) {
-        for (size_t j = 0; j < dst.cols; ++j) {
-            for (size_t k = 0; k < n; ++k) {
-                MAT_AT(dst, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
-            }
-        }
+// SIMD layer for the elementwise kernels, picked at compile time from the target flags
+// (-mavx512f, -mavx2, -march=native, ...). Define NN_SIMD_SCALAR to force plain C loops.
+// Every kernel is written once against the nn_vf_* wrappers below plus a scalar tail.
+#if defined(NN_SIMD_SCALAR)
+#define NN_SIMD_W 1
+#elif defined(__AVX512F__)
+#include <immintrin.h>
+#define NN_SIMD_W 16
+typedef __m512  nn_vf;
+typedef __m512i nn_vi;
+static inline nn_vf nn_vf_load(const float *p)         { return _mm512_loadu_ps(p); }
+static inline void  nn_vf_store(float *p, nn_vf x)      { _mm512_storeu_ps(p, x); }
+static inline nn_vf nn_vf_set1(float x)                 { return _mm512_set1_ps(x); }
+static inline nn_vf nn_vf_add(nn_vf a, nn_vf b)         { return _mm512_add_ps(a, b); }
+static inline nn_vf nn_vf_sub(nn_vf a, nn_vf b)         { return _mm512_sub_ps(a, b); }
+static inline nn_vf nn_vf_mul(nn_vf a, nn_vf b)         { return _mm512_mul_ps(a, b); }
+static inline nn_vf nn_vf_div(nn_vf a, nn_vf b)         { return _mm512_div_ps(a, b); }
+static inline nn_vf nn_vf_sqrt(nn_vf x)                { return _mm512_sqrt_ps(x); }
+static inline nn_vf nn_vf_fma(nn_vf a, nn_vf b, nn_vf c) { return _mm512_fmadd_ps(a, b, c); }
+static inline nn_vf nn_vf_min(nn_vf a, nn_vf b)         { return _mm512_min_ps(a, b); }
+static inline nn_vf nn_vf_max(nn_vf a, nn_vf b)         { return _mm512_max_ps(a, b); }
+static inline nn_vf nn_vf_pos_select(nn_vf x, nn_vf a, nn_vf b) // x > 0 ? a : b
+{
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GT_OQ), b, a);
+}
+static inline nn_vi nn_vf_round(nn_vf x)                { return _mm512_cvtps_epi32(x); }
+static inline nn_vf nn_vi_float(nn_vi x)                { return _mm512_cvtepi32_ps(x); }
+static inline nn_vf nn_vi_pow2(nn_vi n)
+{
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23));
+}
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define NN_SIMD_W 8
+typedef __m256  nn_vf;
+typedef __m256i nn_vi;
+static inline nn_vf nn_vf_load(const float *p)         { return _mm256_loadu_ps(p); }
+static inline void  nn_vf_store(float *p, nn_vf x)      { _mm256_storeu_ps(p, x); }
+static inline nn_vf nn_vf_set1(float x)                 { return _mm256_set1_ps(x); }
+static inline nn_vf nn_vf_add(nn_vf a, nn_vf b)         { return _mm256_add_ps(a, b); }
+static inline nn_vf nn_vf_sub(nn_vf a, nn_vf b)         { return _mm256_sub_ps(a, b); }
+static inline nn_vf nn_vf_mul(nn_vf a, nn_vf b)         { return _mm256_mul_ps(a, b); }
+static inline nn_vf nn_vf_div(nn_vf a, nn_vf b)         { return _mm256_div_ps(a, b); }
+static inline nn_vf nn_vf_sqrt(nn_vf x)                { return _mm256_sqrt_ps(x); }
+#if defined(__FMA__)
+static inline nn_vf nn_vf_fma(nn_vf a, nn_vf b, nn_vf c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+static inline nn_vf nn_vf_fma(nn_vf a, nn_vf b, nn_vf c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+static inline nn_vf nn_vf_min(nn_vf a, nn_vf b)         { return _mm256_min_ps(a, b); }
+static inline nn_vf nn_vf_max(nn_vf a, nn_vf b)         { return _mm256_max_ps(a, b); }
+static inline nn_vf nn_vf_pos_select(nn_vf x, nn_vf a, nn_vf b) // x > 0 ? a : b
+{
+    return _mm256_blendv_ps(b, a, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+static inline nn_vi nn_vf_round(nn_vf x)                { return _mm256_cvtps_epi32(x); }
+static inline nn_vf nn_vi_float(nn_vi x)                { return _mm256_cvtepi32_ps(x); }
+static inline nn_vf nn_vi_pow2(nn_vi n)
+{
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NN_SIMD_W 4
+typedef __m128  nn_vf;
+typedef __m128i nn_vi;
+static inline nn_vf nn_vf_load(const float *p)         { return _mm_loadu_ps(p); }
+static inline void  nn_vf_store(float *p, nn_vf x)      { _mm_storeu_ps(p, x); }
+static inline nn_vf nn_vf_set1(float x)                 { return _mm_set1_ps(x); }
+static inline nn_vf nn_vf_add(nn_vf a, nn_vf b)         { return _mm_add_ps(a, b); }
+static inline nn_vf nn_vf_sub(nn_vf a, nn_vf b)         { return _mm_sub_ps(a, b); }
+static inline nn_vf nn_vf_mul(nn_vf a, nn_vf b)         { return _mm_mul_ps(a, b); }
+static inline nn_vf nn_vf_div(nn_vf a, nn_vf b)         { return _mm_div_ps(a, b); }
+static inline nn_vf nn_vf_sqrt(nn_vf x)                { return _mm_sqrt_ps(x); }
+static inline nn_vf nn_vf_fma(nn_vf a, nn_vf b, nn_vf c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline nn_vf nn_vf_min(nn_vf a, nn_vf b)         { return _mm_min_ps(a, b); }
+static inline nn_vf nn_vf_max(nn_vf a, nn_vf b)         { return _mm_max_ps(a, b); }
+static inline nn_vf nn_vf_pos_select(nn_vf x, nn_vf a, nn_vf b) // x > 0 ? a : b
+{
+    __m128 m = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+static inline nn_vi nn_vf_round(nn_vf x)                { return _mm_cvtps_epi32(x); }
+static inline nn_vf nn_vi_float(nn_vi x)                { return _mm_cvtepi32_ps(x); }
+static inline nn_vf nn_vi_pow2(nn_vi n)
+{
+    return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define NN_SIMD_W 4
+typedef float32x4_t nn_vf;
+typedef int32x4_t   nn_vi;
+static inline nn_vf nn_vf_load(const float *p)         { return vld1q_f32(p); }
+static inline void  nn_vf_store(float *p, nn_vf x)      { vst1q_f32(p, x); }
+static inline nn_vf nn_vf_set1(float x)                 { return vdupq_n_f32(x); }
+static inline nn_vf nn_vf_add(nn_vf a, nn_vf b)         { return vaddq_f32(a, b); }
+static inline nn_vf nn_vf_sub(nn_vf a, nn_vf b)         { return vsubq_f32(a, b); }
+static inline nn_vf nn_vf_mul(nn_vf a, nn_vf b)         { return vmulq_f32(a, b); }
+static inline nn_vf nn_vf_div(nn_vf a, nn_vf b)         { return vdivq_f32(a, b); }
+static inline nn_vf nn_vf_sqrt(nn_vf x)                { return vsqrtq_f32(x); }
+static inline nn_vf nn_vf_fma(nn_vf a, nn_vf b, nn_vf c) { return vfmaq_f32(c, a, b); }
+static inline nn_vf nn_vf_min(nn_vf a, nn_vf b)         { return vminq_f32(a, b); }
+static inline nn_vf nn_vf_max(nn_vf a, nn_vf b)         { return vmaxq_f32(a, b); }
+static inline nn_vf nn_vf_pos_select(nn_vf x, nn_vf a, nn_vf b) // x > 0 ? a : b
+{
+    return vbslq_f32(vcgtq_f32(x, vdupq_n_f32(0.f)), a, b);
+}
+static inline nn_vi nn_vf_round(nn_vf x)                { return vcvtnq_s32_f32(x); }
+static inline nn_vf nn_vi_float(nn_vi x)                { return vcvtq_f32_s32(x); }
+static inline nn_vf nn_vi_pow2(nn_vi n)
+{
+    return vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23));
+}
+#else
+#define NN_SIMD_W 1
+#endif
+
+#if NN_SIMD_W > 1
+// exp(x) as 2^n * p(r) with n = round(x/ln2), r = x - n*ln2 and a degree 5 polynomial for
+// e^r on [-ln2/2, ln2/2] (Cephes expf). Relative error is ~2e-7 over the clamped range.
+static inline nn_vf nn_vf_exp(nn_vf x)
+{
+    x = nn_vf_min(nn_vf_max(x, nn_vf_set1(-87.3f)), nn_vf_set1(88.3f));
+    nn_vi n = nn_vf_round(nn_vf_mul(x, nn_vf_set1(1.44269504f)));
+    nn_vf fn = nn_vi_float(n);
+    nn_vf r = nn_vf_fma(fn, nn_vf_set1(-0.693359375f), x);
+    r = nn_vf_fma(fn, nn_vf_set1(2.12194440e-4f), r);
+
+    nn_vf p = nn_vf_set1(1.9875691500e-4f);
+    p = nn_vf_fma(p, r, nn_vf_set1(1.3981999507e-3f));
+    p = nn_vf_fma(p, r, nn_vf_set1(8.3334519073e-3f));
+    p = nn_vf_fma(p, r, nn_vf_set1(4.1665795894e-2f));
+    p = nn_vf_fma(p, r, nn_vf_set1(1.6666665459e-1f));
+    p = nn_vf_fma(p, r, nn_vf_set1(5.0000001201e-1f));
+    p = nn_vf_fma(p, nn_vf_mul(r, r), nn_vf_add(r, nn_vf_set1(1.f)));
+
+    return nn_vf_mul(p, nn_vi_pow2(n));
+}
+
+static inline nn_vf nn_vf_sigmoid(nn_vf x)
+{
+    nn_vf one = nn_vf_set1(1.f);
+    return nn_vf_div(one, nn_vf_add(one, nn_vf_exp(nn_vf_mul(x, nn_vf_set1(-1.f)))));
+}
+
+// (e^2x - 1)/(e^2x + 1): absolute error ~1e-7, the relative error grows near 0
+static inline nn_vf nn_vf_tanh(nn_vf x)
+{
+    nn_vf one = nn_vf_set1(1.f);
+    nn_vf e = nn_vf_exp(nn_vf_add(x, x));
+    return nn_vf_div(nn_vf_sub(e, one), nn_vf_add(e, one));
+}
+
+static inline nn_vf nn_vf_tanh_fast(nn_vf x)
+{
+    nn_vf one = nn_vf_set1(1.f), mone = nn_vf_set1(-1.f);
+    x = nn_vf_min(nn_vf_max(x, nn_vf_set1(-9.f)), nn_vf_set1(9.f));
+    nn_vf x2 = nn_vf_mul(x, x);
+    nn_vf p = nn_vf_add(x2, nn_vf_set1(378.f));
+    p = nn_vf_fma(p, x2, nn_vf_set1(17325.f));
+    p = nn_vf_mul(x, nn_vf_fma(p, x2, nn_vf_set1(135135.f)));
+    nn_vf q = nn_vf_fma(x2, nn_vf_set1(28.f), nn_vf_set1(3150.f));
+    q = nn_vf_fma(q, x2, nn_vf_set1(62370.f));
+    q = nn_vf_fma(q, x2, nn_vf_set1(135135.f));
+    return nn_vf_min(nn_vf_max(nn_vf_div(p, q), mone), one);
+}
+
+static inline nn_vf nn_vf_gelu(nn_vf x)
+{
+    nn_vf half = nn_vf_set1(0.5f);
+    nn_vf x2 = nn_vf_mul(x, x);
+    nn_vf u = nn_vf_mul(nn_vf_mul(x, nn_vf_set1(NN_GELU_K)), nn_vf_fma(x2, nn_vf_set1(NN_GELU_C), nn_vf_set1(1.f)));
+    nn_vf hx = nn_vf_mul(half, x);
+    return nn_vf_fma(hx, nn_vf_tanh(u), hx);
+}
+
+// d/dx of the tanh form of GELU, from its input x
+static inline nn_vf nn_vf_gelu_grad(nn_vf x)
+{
+    nn_vf half = nn_vf_set1(0.5f), one = nn_vf_set1(1.f);
+    nn_vf x2 = nn_vf_mul(x, x);
+    nn_vf k = nn_vf_set1(NN_GELU_K);
+    nn_vf t = nn_vf_tanh(nn_vf_mul(nn_vf_mul(x, k), nn_vf_fma(x2, nn_vf_set1(NN_GELU_C), one)));
+    nn_vf du = nn_vf_mul(k, nn_vf_fma(x2, nn_vf_set1(3.f*NN_GELU_C), one));
+    nn_vf sech2 = nn_vf_sub(one, nn_vf_mul(t, t));
+    return nn_vf_fma(nn_vf_mul(half, x), nn_vf_mul(sech2, du), nn_vf_mul(half, nn_vf_add(one, t)));
+}
+#endif // NN_SIMD_W > 1
+
+static inline float nn_tanh_fast(float x)
+{
+    x = fminf(fmaxf(x, -9.f), 9.f);
+    float x2 = x*x;
+    float p = x*(135135.f + x2*(17325.f + x2*(378.f + x2)));
+    float q = 135135.f + x2*(62370.f + x2*(3150.f + 28.f*x2));
+    return fminf(fmaxf(p/q, -1.f), 1.f);
+}
+
+// Derivative of act at the point where it output y; GELU takes its input instead, being the
+// only one whose derivative is not a function of its output.
+static inline float nn_act_grad(NN_Act act, float y)
+{
+    switch (act) {
+    case NN_ACT_SIG:
+    case NN_ACT_SIG_FAST:  return y*(1.f - y);
+    case NN_ACT_TANH:
+    case NN_ACT_TANH_FAST: return 1.f - y*y;
+    case NN_ACT_RELU:      return y > 0 ? 1.f : 0.f;
+    case NN_ACT_LRELU:     return y > 0 ? 1.f : NN_LRELU_ALPHA;
+    case NN_ACT_GELU: {
+        float t = tanhf(NN_GELU_K*y*(1.f + NN_GELU_C*y*y));
+        return 0.5f*(1.f + t) + 0.5f*y*(1.f - t*t)*NN_GELU_K*(1.f + 3.f*NN_GELU_C*y*y);
+    }
+    case NN_ACT_NONE:
+    case NN_ACT_COUNT:     break;
     }
+    return 1.f;
 }
 
-inline void mat_print(Mat m, const char *name)
+// Contiguous span kernels. The mat_* elementwise functions call these once per row, or once
+// for the whole matrix when stride == cols.
+static inline void nn_span_fill(float *d, size_t n, float x)
 {
-    printf("%s = [\n", name);
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            printf("    %f ", MAT_AT(m, i, j));
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf v = nn_vf_set1(x);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, v);
+#endif
+    for (; i < n; ++i) d[i] = x;
+}
+
+static inline void nn_span_copy(float *d, const float *s, size_t n)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_load(s + i));
+#endif
+    for (; i < n; ++i) d[i] = s[i];
+}
+
+static inline void nn_span_add(float *d, const float *s, size_t n)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_add(nn_vf_load(d + i), nn_vf_load(s + i)));
+#endif
+    for (; i < n; ++i) d[i] += s[i];
+}
+
+// d = a*s
+static inline void nn_span_copy_scaled(float *d, const float *s, size_t n, float a)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf va = nn_vf_set1(a);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_mul(va, nn_vf_load(s + i)));
+#endif
+    for (; i < n; ++i) d[i] = a*s[i];
+}
+
+// d += a*b, elementwise
+static inline void nn_span_fma(float *d, const float *a, const float *b, size_t n)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_fma(nn_vf_load(a + i), nn_vf_load(b + i), nn_vf_load(d + i)));
+#endif
+    for (; i < n; ++i) d[i] += a[i]*b[i];
+}
+
+// d = a*b, elementwise
+static inline void nn_span_mul(float *d, const float *a, const float *b, size_t n)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_mul(nn_vf_load(a + i), nn_vf_load(b + i)));
+#endif
+    for (; i < n; ++i) d[i] = a[i]*b[i];
+}
+
+// d += a*s
+static inline void nn_span_axpy(float *d, const float *s, size_t n, float a)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf va = nn_vf_set1(a);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_fma(va, nn_vf_load(s + i), nn_vf_load(d + i)));
+#endif
+    for (; i < n; ++i) d[i] += a*s[i];
+}
+
+static inline void nn_span_scale(float *d, size_t n, float a)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf va = nn_vf_set1(a);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_mul(va, nn_vf_load(d + i)));
+#endif
+    for (; i < n; ++i) d[i] *= a;
+}
+
+static inline void nn_span_sig(float *d, size_t n)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_sigmoid(nn_vf_load(d + i)));
+#endif
+    for (; i < n; ++i) d[i] = sigmoidf(d[i]);
+}
+
+#define NN_SPAN_MAP(f) for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, f(nn_vf_load(d + i)))
+
+static inline void nn_span_act(float *d, size_t n, NN_Act act)
+{
+    if (act == NN_ACT_NONE) return;
+    if (act == NN_ACT_SIG) {
+        nn_span_sig(d, n);
+        return;
+    }
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf zero = nn_vf_set1(0.f), alpha = nn_vf_set1(NN_LRELU_ALPHA);
+    nn_vf half = nn_vf_set1(0.5f);
+    switch (act) {
+    case NN_ACT_TANH:      NN_SPAN_MAP(nn_vf_tanh); break;
+    case NN_ACT_TANH_FAST: NN_SPAN_MAP(nn_vf_tanh_fast); break;
+    case NN_ACT_GELU:      NN_SPAN_MAP(nn_vf_gelu); break;
+    case NN_ACT_RELU:
+        for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) nn_vf_store(d + i, nn_vf_max(nn_vf_load(d + i), zero));
+        break;
+    case NN_ACT_LRELU:
+        for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) {
+            nn_vf x = nn_vf_load(d + i);
+            nn_vf_store(d + i, nn_vf_pos_select(x, x, nn_vf_mul(alpha, x)));
         }
-        printf("\n");
+        break;
+    case NN_ACT_SIG_FAST:
+        for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) {
+            nn_vf t = nn_vf_tanh_fast(nn_vf_mul(half, nn_vf_load(d + i)));
+            nn_vf_store(d + i, nn_vf_fma(half, t, half));
+        }
+        break;
+    default: break;
     }
-    printf("]\n");
+#endif
+    for (; i < n; ++i) d[i] = nn_act(act, d[i]);
 }
 
-inline void mat_rand(Mat m, float low, float high)
+// d *= act'(.) at y, the activation's output (its input for GELU, see nn_act_grad)
+static inline void nn_span_act_grad(float *d, const float *y, size_t n, NN_Act act)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = rand_float() * (high - low) + low;
+    if (act == NN_ACT_NONE) return;
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf one = nn_vf_set1(1.f), zero = nn_vf_set1(0.f), alpha = nn_vf_set1(NN_LRELU_ALPHA);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) {
+        nn_vf yi = nn_vf_load(y + i), g;
+        switch (act) {
+        case NN_ACT_SIG:
+        case NN_ACT_SIG_FAST:  g = nn_vf_mul(yi, nn_vf_sub(one, yi)); break;
+        case NN_ACT_TANH:
+        case NN_ACT_TANH_FAST: g = nn_vf_sub(one, nn_vf_mul(yi, yi)); break;
+        case NN_ACT_RELU:      g = nn_vf_pos_select(yi, one, zero); break;
+        case NN_ACT_LRELU:     g = nn_vf_pos_select(yi, one, alpha); break;
+        case NN_ACT_GELU:      g = nn_vf_gelu_grad(yi); break;
+        default:               g = one; break;
         }
+        nn_vf_store(d + i, nn_vf_mul(nn_vf_load(d + i), g));
     }
+#endif
+    for (; i < n; ++i) d[i] *= nn_act_grad(act, y[i]);
 }
 
-inline void mat_xavier_init(Mat m, size_t inputs, size_t outputs)
+// Reproducible reductions. A block of up to NN_SUM_BLOCK floats is accumulated into
+// NN_SUM_LANES interleaved partial sums, which are folded in a fixed tree; longer spans are
+// split on block boundaries and added pairwise. Every SIMD width, and the scalar fallback,
+// adds the same partials in the same order, so the result depends on n and the data only.
+// That holds as long as the compiler does not contract mul+add into FMA, which rounds once
+// instead of twice: build with -ffp-contract=off (CMakeLists.txt does). GCC implies it under
+// -std=c11, Clang and GCC's GNU modes contract by default. The error grows with log(n).
+#ifndef NN_SUM_BLOCK
+#define  NN_SUM_BLOCK 1024
+#endif // NN_SUM_BLOCK
+#define  NN_SUM_LANES 16
+
+// Sum of a[i]*b[i], or of a[i] when b is NULL; n <= NN_SUM_BLOCK
+static inline float nn_dot_block(const float *a, const float *b, size_t n)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = xavier_init(inputs, outputs);
+    float acc[NN_SUM_LANES] = {0};
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf v[NN_SUM_LANES/NN_SIMD_W];
+    for (size_t k = 0; k < NN_SUM_LANES/NN_SIMD_W; ++k) v[k] = nn_vf_set1(0.f);
+    for (; i + NN_SUM_LANES <= n; i += NN_SUM_LANES) {
+        for (size_t k = 0; k < NN_SUM_LANES/NN_SIMD_W; ++k) {
+            nn_vf x = nn_vf_load(a + i + k*NN_SIMD_W);
+            if (b) x = nn_vf_mul(x, nn_vf_load(b + i + k*NN_SIMD_W));
+            v[k] = nn_vf_add(v[k], x);
         }
     }
+    for (size_t k = 0; k < NN_SUM_LANES/NN_SIMD_W; ++k) nn_vf_store(acc + k*NN_SIMD_W, v[k]);
+#endif
+    for (; i + NN_SUM_LANES <= n; i += NN_SUM_LANES) {
+        for (size_t k = 0; k < NN_SUM_LANES; ++k) acc[k] += b ? a[i + k]*b[i + k] : a[i + k];
+    }
+    for (size_t k = 0; k < n - i; ++k) acc[k] += b ? a[i + k]*b[i + k] : a[i + k];
+    for (size_t h = NN_SUM_LANES/2; h > 0; h /= 2) {
+        for (size_t k = 0; k < h; ++k) acc[k] += acc[k + h];
+    }
+    return acc[0];
 }
 
-inline Mat mat_row(Mat m, size_t row)
+static inline float nn_dot_pairwise(const float *a, const float *b, size_t n)
 {
-    return (Mat){
-        .rows = 1,
-        .cols = m.cols,
-        .stride = m.stride,
-        .es = &MAT_AT(m, row, 0)
-    };
+    if (n <= NN_SUM_BLOCK) return nn_dot_block(a, b, n);
+    size_t h = (n/2 + NN_SUM_BLOCK - 1)/NN_SUM_BLOCK*NN_SUM_BLOCK;
+    return nn_dot_pairwise(a, b, h) + nn_dot_pairwise(a + h, b ? b + h : NULL, n - h);
 }
 
+inline float nn_sum(const float *x, size_t n)
+{
+    return nn_dot_pairwise(x, NULL, n);
+}
 
-inline void mat_copy(Mat dst, Mat src)
+inline float nn_dot(const float *a, const float *b, size_t n)
 {
-    NN_ASSERT(dst.rows == src.rows);
-    NN_ASSERT(dst.cols == src.cols);
-    for (size_t i = 0; i < dst.rows; ++i) {
-        for (size_t j = 0; j < dst.cols; ++j) {
-            MAT_AT(dst, i, j) = MAT_AT(src, i, j);
-        }
-    }
+    return nn_dot_pairwise(a, b, n);
+}
+
+// Compensated running sum (Kahan): *e carries the rounding error of every addition to *s
+static inline void nn_kahan_add(float *s, float *e, float x)
+{
+    float y = x - *e;
+    float t = *s + y;
+    *e = (t - *s) - y;
+    *s = t;
+}
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+inline uint64_t nn_clock_ns(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if (tb.denom == 0) mach_timebase_info(&tb);
+    return mach_absolute_time()*tb.numer/tb.denom;
+#elif defined(_WIN32)
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (uint64_t)((double)t.QuadPart*1e9/(double)f.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000ull + (uint64_t)t.tv_nsec;
+#endif
+}
+
+#ifdef NN_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+NN_ProfCounter nn_prof_counters[NN_PROF_COUNT];
+
+static const char *nn_prof_names[NN_PROF_COUNT] = {
+    "mat_dot", "mat_dot_at", "mat_dot_bt", "mat_dense", "mat_sum", "mat_sig", "mat_act",
+    "mat_copy", "nn_backprop", "nn_learn", "nn_opt_step",
+};
+
+static inline uint64_t nn_prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return nn_clock_ns();
+#endif
+}
+
+static void nn_prof_atexit(void)
+{
+    nn_prof_print(stderr);
+}
+
+static inline void nn_prof_add(NN_ProfKernel k, uint64_t ticks, uint64_t flops, uint64_t bytes)
+{
+    static int registered;
+    NN_ProfCounter *c = &nn_prof_counters[k];
+#if defined(__GNUC__)
+    if (!__atomic_exchange_n(&registered, 1, __ATOMIC_RELAXED)) atexit(nn_prof_atexit);
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->flops, flops, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+#else
+    if (!registered) {
+        registered = 1;
+        atexit(nn_prof_atexit);
+    }
+    c->calls += 1;
+    c->ticks += ticks;
+    c->flops += flops;
+    c->bytes += bytes;
+#endif
+}
+
+inline void nn_prof_print(FILE *f)
+{
+    fprintf(f, "%-12s %10s %14s %12s %12s %12s %9s\n",
+            "kernel", "calls", "ticks", "ticks/call", "MFLOP", "MB", "flop/tick");
+    for (size_t k = 0; k < NN_PROF_COUNT; ++k) {
+        NN_ProfCounter c = nn_prof_counters[k];
+        if (c.calls == 0) continue;
+        fprintf(f, "%-12s %10llu %14llu %12.1f %12.3f %12.3f %9.3f\n", nn_prof_names[k],
+                (unsigned long long)c.calls, (unsigned long long)c.ticks,
+                (double)c.ticks/(double)c.calls, (double)c.flops*1e-6, (double)c.bytes*1e-6,
+                c.ticks ? (double)c.flops/(double)c.ticks : 0.0);
+    }
+}
+
+inline void nn_prof_reset(void)
+{
+    memset(nn_prof_counters, 0, sizeof(nn_prof_counters));
+}
+
+#define NN_PROF_BEGIN() uint64_t nn_prof_t0 = nn_prof_ticks()
+#define NN_PROF_END(k, flops, bytes) \
+    nn_prof_add((k), nn_prof_ticks() - nn_prof_t0, (uint64_t)(flops), (uint64_t)(bytes))
+#else
+#define NN_PROF_BEGIN() do {} while (0)
+#define NN_PROF_END(k, flops, bytes) do {} while (0)
+#endif // NN_PROFILE
+
+inline float sigmoidf(float x)
+{
+    return 1.f / (1.f + expf(-x));
+}
+
+inline float nn_act(NN_Act act, float x)
+{
+    switch (act) {
+    case NN_ACT_SIG:       return sigmoidf(x);
+    case NN_ACT_TANH:      return tanhf(x);
+    case NN_ACT_RELU:      return x > 0 ? x : 0.f;
+    case NN_ACT_LRELU:     return x > 0 ? x : NN_LRELU_ALPHA*x;
+    case NN_ACT_GELU:      return 0.5f*x*(1.f + tanhf(NN_GELU_K*x*(1.f + NN_GELU_C*x*x)));
+    case NN_ACT_SIG_FAST:  return 0.5f + 0.5f*nn_tanh_fast(0.5f*x);
+    case NN_ACT_TANH_FAST: return nn_tanh_fast(x);
+    case NN_ACT_NONE:
+    case NN_ACT_COUNT:     break;
+    }
+    return x;
+}
+
+static inline uint64_t nn_splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// lowbias32 integer hash (Chris Wellons), a bijection on 32 bits
+static inline uint32_t nn_rng_mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Two rounds keyed by the low and high key words; the high counter word only changes every
+// 2^32 draws, so it is folded into the second key outside the bulk loops.
+static inline uint32_t nn_rng_hash(uint32_t lo, uint32_t k0, uint32_t k1)
+{
+    return nn_rng_mix(nn_rng_mix(lo ^ k0) ^ k1);
+}
+
+static inline uint32_t nn_rng_k1(const NN_Rng *rng)
+{
+    return (uint32_t)(rng->key >> 32) ^ (uint32_t)(rng->counter >> 32)*0x9E3779B9u;
+}
+
+inline NN_Rng nn_rng_seed(uint64_t seed, uint64_t stream)
+{
+    return (NN_Rng){ .key = nn_splitmix64(seed ^ nn_splitmix64(stream)), .counter = 0 };
+}
+
+inline uint32_t nn_rng_u32(NN_Rng *rng)
+{
+    uint32_t x = nn_rng_hash((uint32_t)rng->counter, (uint32_t)rng->key, nn_rng_k1(rng));
+    rng->counter += 1;
+    return x;
+}
+
+inline void nn_rng_fill(NN_Rng *rng, float *dst, size_t n, float low, float high)
+{
+    float scale = (high - low)*0x1p-24f;
+    uint32_t k0 = (uint32_t)rng->key;
+    while (n > 0) {
+        uint32_t lo = (uint32_t)rng->counter;
+        uint32_t k1 = nn_rng_k1(rng);
+        uint64_t left = 0x100000000ull - lo; // draws until the high counter word changes
+        size_t chunk = n < left ? n : (size_t)left;
+        for (size_t i = 0; i < chunk; ++i) {
+            dst[i] = low + (float)(int32_t)(nn_rng_hash(lo + (uint32_t)i, k0, k1) >> 8)*scale;
+        }
+        rng->counter += chunk;
+        dst += chunk;
+        n -= chunk;
+    }
+}
+
+inline float rand_float(NN_Rng *rng)
+{
+    return (float)(int32_t)(nn_rng_u32(rng) >> 8)*0x1p-24f;
+}
+
+inline float xavier_init(NN_Rng *rng, size_t inputs, size_t outputs)
+{
+    float limit = sqrtf(6.f/(float)(inputs + outputs));
+    return rand_float(rng)*2*limit - limit;
+}
+
+inline Mat mat_alloc(size_t rows, size_t cols) // allocate memory for the matrix struct
+{
+    Mat m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.es = nn_mem_alloc(sizeof(*m.es) * rows * cols);
+    NN_ASSERT(m.es != NULL);
+    return m;
+}
+
+inline void mat_free(Mat *m)
+{
+    if (m->es) {
+        nn_mem_free(m->es);
+        m->es = NULL;
+    }
+    m->rows = m->cols = m->stride = 0;
+}
+
+inline void mat_fill(Mat m, float x)
+{
+    if (m.stride == m.cols) {
+        nn_span_fill(m.es, m.rows*m.cols, x);
+        return;
+    }
+    for (size_t i = 0; i < m.rows; ++i) {
+        nn_span_fill(&MAT_AT(m, i, 0), m.cols, x);
+    }
+}
+
+inline void mat_sum(Mat dst, Mat a)
+{
+    NN_ASSERT(dst.rows == a.rows || a.rows == 1);
+    NN_ASSERT(dst.cols == a.cols);
+    NN_PROF_BEGIN();
+    if (dst.rows == a.rows && dst.stride == dst.cols && a.stride == a.cols) {
+        nn_span_add(dst.es, a.es, dst.rows*dst.cols);
+    } else {
+        for (size_t i = 0; i < dst.rows; ++i){
+            size_t r = a.rows == 1 ? 0 : i;
+            nn_span_add(&MAT_AT(dst, i, 0), &MAT_AT(a, r, 0), dst.cols);
+        }
+    }
+    NN_PROF_END(NN_PROF_SUM, dst.rows*dst.cols, 3*sizeof(float)*dst.rows*dst.cols);
+}
+
+inline void mat_sig(Mat m)
+{
+    NN_PROF_BEGIN();
+    if (m.stride == m.cols) {
+        nn_span_sig(m.es, m.rows*m.cols);
+    } else {
+        for (size_t i = 0; i < m.rows; ++i) {
+            nn_span_sig(&MAT_AT(m, i, 0), m.cols);
+        }
+    }
+    NN_PROF_END(NN_PROF_SIG, m.rows*m.cols, 2*sizeof(float)*m.rows*m.cols);
+}
+
+inline void mat_act(Mat m, NN_Act act)
+{
+    NN_PROF_BEGIN();
+    if (m.stride == m.cols) {
+        nn_span_act(m.es, m.rows*m.cols, act);
+    } else {
+        for (size_t i = 0; i < m.rows; ++i) {
+            nn_span_act(&MAT_AT(m, i, 0), m.cols, act);
+        }
+    }
+    NN_PROF_END(NN_PROF_ACT, m.rows*m.cols, 2*sizeof(float)*m.rows*m.cols);
+}
+
+// Blocked GEMM behind mat_dot_ex: dst = alpha*op(a)*op(b) + beta*dst.
+// Panels of op(b) (KC x NC) and blocks of op(a) (MC x KC) are packed into contiguous
+// NR-wide and MR-tall slivers, so the MR x NR microkernel streams both operands with unit
+// stride and keeps its accumulators in registers. Packing reads through MAT_AT, which is
+// where the transposes and arbitrary strides (mat_row views, strided ti/to) are absorbed.
+static inline void mat_gemm_pack_a(float *ap, Mat a, int ta, size_t i0, size_t mc, size_t p0, size_t kc)
+{
+    for (size_t ir = 0; ir < mc; ir += NN_GEMM_MR) {
+        size_t mr = mc - ir < NN_GEMM_MR ? mc - ir : NN_GEMM_MR;
+        for (size_t p = 0; p < kc; ++p) {
+            size_t i = 0;
+            for (; i < mr; ++i) {
+                *ap++ = ta ? MAT_AT(a, p0 + p, i0 + ir + i) : MAT_AT(a, i0 + ir + i, p0 + p);
+            }
+            for (; i < NN_GEMM_MR; ++i) {
+                *ap++ = 0;
+            }
+        }
+    }
+}
+
+static inline void mat_gemm_pack_b(float *bp, Mat b, int tb, size_t p0, size_t kc, size_t j0, size_t nc)
+{
+    for (size_t jr = 0; jr < nc; jr += NN_GEMM_NR) {
+        size_t nr = nc - jr < NN_GEMM_NR ? nc - jr : NN_GEMM_NR;
+        for (size_t p = 0; p < kc; ++p) {
+            size_t j = 0;
+            for (; j < nr; ++j) {
+                *bp++ = tb ? MAT_AT(b, j0 + jr + j, p0 + p) : MAT_AT(b, p0 + p, j0 + jr + j);
+            }
+            for (; j < NN_GEMM_NR; ++j) {
+                *bp++ = 0;
+            }
+        }
+    }
+}
+
+// The slivers are zero padded, so the full MR x NR tile is always computed and only the
+// store (mat_gemm_store) is clipped to mr x nr. With GCC/Clang vector extensions the accumulators are
+// explicit vectors; left to the auto-vectorizer the tile spills depending on its shape.
+#if defined(__GNUC__)
+
+typedef float mat_gemm_vec __attribute__((vector_size(NN_GEMM_VW*sizeof(float))));
+#define MAT_GEMM_NV (NN_GEMM_NR/NN_GEMM_VW)
+
+static inline void mat_gemm_kernel(size_t kc, const float *ap, const float *bp,
+                                   float tile[NN_GEMM_MR][NN_GEMM_NR])
+{
+    mat_gemm_vec acc[NN_GEMM_MR][MAT_GEMM_NV];
+    memset(acc, 0, sizeof(acc));
+    for (size_t p = 0; p < kc; ++p) {
+        mat_gemm_vec b[MAT_GEMM_NV];
+        memcpy(b, bp, sizeof(b));
+        for (size_t i = 0; i < NN_GEMM_MR; ++i) {
+            mat_gemm_vec x = {0};
+            x += ap[i];
+            for (size_t v = 0; v < MAT_GEMM_NV; ++v) {
+                acc[i][v] += x*b[v];
+            }
+        }
+        ap += NN_GEMM_MR;
+        bp += NN_GEMM_NR;
+    }
+
+    memcpy(tile, acc, sizeof(acc));
+}
+#else
+static inline void mat_gemm_kernel(size_t kc, const float *ap, const float *bp,
+                                   float acc[NN_GEMM_MR][NN_GEMM_NR])
+{
+    for (size_t i = 0; i < NN_GEMM_MR; ++i) {
+        nn_span_fill(acc[i], NN_GEMM_NR, 0);
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        for (size_t i = 0; i < NN_GEMM_MR; ++i) {
+            float x = ap[i];
+            for (size_t j = 0; j < NN_GEMM_NR; ++j) {
+                acc[i][j] += x*bp[j];
+            }
+        }
+        ap += NN_GEMM_MR;
+        bp += NN_GEMM_NR;
+    }
+}
+#endif // __GNUC__
+
+// Epilogue of one tile: scale by alpha, add beta times what is already in c, then the bias,
+// then apply the activation, all on the L1-resident tile before the single store to c.
+// beta == 0 skips the load of c entirely.
+static inline void mat_gemm_store(float *c, size_t ldc, size_t mr, size_t nr,
+                                  float tile[NN_GEMM_MR][NN_GEMM_NR],
+                                  float alpha, float beta, const float *bias, NN_Act act)
+{
+    for (size_t i = 0; i < mr; ++i) {
+        float *t = tile[i];
+        if (alpha != 1.f) {
+            nn_span_scale(t, nr, alpha);
+        }
+        if (beta == 1.f) {
+            nn_span_add(t, c + i*ldc, nr);
+        } else if (beta != 0.f) {
+            nn_span_axpy(t, c + i*ldc, nr, beta);
+        }
+        if (bias) {
+            nn_span_add(t, bias, nr);
+        }
+        nn_span_act(t, nr, act);
+        nn_span_copy(c + i*ldc, t, nr);
+    }
+}
+
+// dst = act(alpha*op(a)*op(b) + beta*dst + bias) where bias (a single row) is optional and act
+// may be NN_ACT_NONE. beta and the bias go in with the first K block (later blocks add what
+// the earlier ones stored) and the activation with the last one.
+// Floats of packing scratch mat_gemm needs for an m x n result with inner dimension k
+static inline size_t mat_gemm_scratch(size_t m, size_t n, size_t k)
+{
+    size_t kcmax = k < NN_GEMM_KC ? k : NN_GEMM_KC;
+    size_t mcmax = m < NN_GEMM_MC ? m : NN_GEMM_MC;
+    size_t ncmax = n < NN_GEMM_NC ? n : NN_GEMM_NC;
+    mcmax = (mcmax + NN_GEMM_MR - 1)/NN_GEMM_MR*NN_GEMM_MR;
+    ncmax = (ncmax + NN_GEMM_NR - 1)/NN_GEMM_NR*NN_GEMM_NR;
+    return kcmax*(mcmax + ncmax);
+}
+
+// scratch holds at least mat_gemm_scratch(...) floats, or is NULL to allocate it per call.
+static inline void mat_gemm(Mat dst, Mat a, int ta, Mat b, int tb,
+                            float alpha, float beta, const float *bias, NN_Act act,
+                            float *scratch)
+{
+    size_t m = dst.rows, n = dst.cols, k = ta ? a.rows : a.cols;
+
+    size_t kcmax = k < NN_GEMM_KC ? k : NN_GEMM_KC;
+    size_t mcmax = m < NN_GEMM_MC ? m : NN_GEMM_MC;
+    mcmax = (mcmax + NN_GEMM_MR - 1)/NN_GEMM_MR*NN_GEMM_MR;
+
+    float *ap = scratch;
+    if (!ap) {
+        ap = nn_mem_alloc(sizeof(float)*mat_gemm_scratch(m, n, k));
+        NN_ASSERT(ap != NULL);
+    }
+    float *bp = ap + kcmax*mcmax;
+
+    for (size_t jc = 0; jc < n; jc += NN_GEMM_NC) {
+        size_t nc = n - jc < NN_GEMM_NC ? n - jc : NN_GEMM_NC;
+        for (size_t pc = 0; pc < k; pc += NN_GEMM_KC) {
+            size_t kc = k - pc < NN_GEMM_KC ? k - pc : NN_GEMM_KC;
+            mat_gemm_pack_b(bp, b, tb, pc, kc, jc, nc);
+            for (size_t ic = 0; ic < m; ic += NN_GEMM_MC) {
+                size_t mc = m - ic < NN_GEMM_MC ? m - ic : NN_GEMM_MC;
+                mat_gemm_pack_a(ap, a, ta, ic, mc, pc, kc);
+                int first = pc == 0, last = pc + kc == k;
+                for (size_t jr = 0; jr < nc; jr += NN_GEMM_NR) {
+                    size_t nr = nc - jr < NN_GEMM_NR ? nc - jr : NN_GEMM_NR;
+                    for (size_t ir = 0; ir < mc; ir += NN_GEMM_MR) {
+                        size_t mr = mc - ir < NN_GEMM_MR ? mc - ir : NN_GEMM_MR;
+                        float tile[NN_GEMM_MR][NN_GEMM_NR];
+                        mat_gemm_kernel(kc, ap + ir*kc, bp + jr*kc, tile);
+                        mat_gemm_store(&MAT_AT(dst, ic + ir, jc + jr), dst.stride, mr, nr, tile,
+                                       alpha, first ? beta : 1.f,
+                                       first && bias ? bias + jc + jr : NULL,
+                                       last ? act : NN_ACT_NONE);
+                    }
+                }
+            }
+        }
+    }
+
+    if (!scratch) {
+        nn_mem_free(ap);
+    }
+}
+
+#ifdef NN_SGEMM
+// Row-major cblas call on the views as they are: Mat.stride is the leading dimension, so
+// mat_row/mat_rows/mat_cols views and strided ti/to reach BLAS without a copy.
+static inline void mat_blas(Mat dst, Mat a, int ta, Mat b, int tb, float alpha, float beta)
+{
+    size_t k = ta ? a.rows : a.cols;
+    NN_SGEMM(CblasRowMajor, ta ? CblasTrans : CblasNoTrans, tb ? CblasTrans : CblasNoTrans,
+             (int)dst.rows, (int)dst.cols, (int)k, alpha, a.es, (int)a.stride,
+             b.es, (int)b.stride, beta, dst.es, (int)dst.stride);
+}
+#endif // NN_SGEMM
+
+#ifdef NN_PROFILE
+// Bytes of one pass over both operands plus the read and write of dst, ignoring reuse
+static inline size_t mat_dot_bytes(Mat dst, size_t k)
+{
+    return sizeof(float)*(dst.rows*k + k*dst.cols + 2*dst.rows*dst.cols);
+}
+#endif // NN_PROFILE
+
+// Below NN_GEMM_SMALL multiply-adds, packing costs more than it saves and the plain
+// loops are used instead. Both paths fold beta into the first write of each row of dst.
+// scratch is the GEMM packing space as in mat_gemm, NULL to allocate it per call.
+static inline void mat_dot_scratch(Mat dst, Mat a, int ta, Mat b, int tb, float alpha, float beta,
+                                   float *scratch)
+{
+    size_t m = ta ? a.cols : a.rows, n = ta ? a.rows : a.cols;
+    NN_ASSERT(n == (tb ? b.cols : b.rows));
+    NN_ASSERT(dst.rows == m);
+    NN_ASSERT(dst.cols == (tb ? b.rows : b.cols));
+
+    NN_PROF_BEGIN();
+    if (n == 0) {
+        for (size_t i = 0; i < dst.rows; ++i) {
+            float *d = &MAT_AT(dst, i, 0);
+            if (beta == 0.f) {
+                nn_span_fill(d, dst.cols, 0);
+            } else {
+                nn_span_scale(d, dst.cols, beta);
+            }
+        }
+    } else if (dst.rows*dst.cols*n >= NN_GEMM_SMALL) {
+#ifdef NN_SGEMM
+        (void)scratch;
+        mat_blas(dst, a, ta, b, tb, alpha, beta);
+#else
+        mat_gemm(dst, a, ta, b, tb, alpha, beta, NULL, NN_ACT_NONE, scratch);
+#endif // NN_SGEMM
+    } else if (tb) {
+        for (size_t i = 0; i < dst.rows; ++i) {
+            for (size_t j = 0; j < dst.cols; ++j) {
+                float acc = 0;
+                for (size_t k = 0; k < n; ++k) {
+                    acc += (ta ? MAT_AT(a, k, i) : MAT_AT(a, i, k))*MAT_AT(b, j, k);
+                }
+                float *d = &MAT_AT(dst, i, j);
+                *d = beta == 0.f ? alpha*acc : alpha*acc + beta**d;
+            }
+        }
+    } else {
+        // Row i of dst is a combination of the rows of b, so it streams with unit stride
+        for (size_t i = 0; i < dst.rows; ++i) {
+            float *d = &MAT_AT(dst, i, 0);
+            for (size_t k = 0; k < n; ++k) {
+                float x = alpha*(ta ? MAT_AT(a, k, i) : MAT_AT(a, i, k));
+                if (k > 0 || beta == 1.f) {
+                    nn_span_axpy(d, &MAT_AT(b, k, 0), dst.cols, x);
+                } else if (beta == 0.f) {
+                    nn_span_copy_scaled(d, &MAT_AT(b, k, 0), dst.cols, x);
+                } else {
+                    nn_span_scale(d, dst.cols, beta);
+                    nn_span_axpy(d, &MAT_AT(b, k, 0), dst.cols, x);
+                }
+            }
+        }
+    }
+    NN_PROF_END(ta ? NN_PROF_DOT_AT : tb ? NN_PROF_DOT_BT : NN_PROF_DOT,
+                2*dst.rows*dst.cols*n, mat_dot_bytes(dst, n));
+}
+
+inline void mat_dot_ex(Mat dst, Mat a, int ta, Mat b, int tb, float alpha, float beta)
+{
+    mat_dot_scratch(dst, a, ta, b, tb, alpha, beta, NULL);
+}
+
+inline void mat_dot(Mat dst, Mat a, Mat b)
+{
+    mat_dot_ex(dst, a, 0, b, 0, 1.f, 1.f);
+}
+
+inline void mat_dot_at(Mat dst, Mat a, Mat b)
+{
+    mat_dot_ex(dst, a, 1, b, 0, 1.f, 1.f);
+}
+
+inline void mat_dot_bt(Mat dst, Mat a, Mat b)
+{
+    mat_dot_ex(dst, a, 0, b, 1, 1.f, 1.f);
+}
+
+// Fused dense layer: each row of dst starts from the bias, accumulates x*w and gets the
+// activation applied while it is still hot, instead of three separate passes over dst.
+static inline void mat_dense_scratch(Mat dst, Mat x, Mat w, Mat b, NN_Act act, float *scratch)
+{
+    NN_ASSERT(x.cols == w.rows);
+    NN_ASSERT(dst.rows == x.rows);
+    NN_ASSERT(dst.cols == w.cols);
+    NN_ASSERT(b.rows == 1 && b.cols == w.cols);
+
+    NN_PROF_BEGIN();
+    if (dst.rows*dst.cols*x.cols >= NN_GEMM_SMALL) {
+#ifdef NN_SGEMM
+        // BLAS has no epilogue: the bias is stored first and the activation is a pass after
+        (void)scratch;
+        for (size_t i = 0; i < dst.rows; ++i) {
+            nn_span_copy(&MAT_AT(dst, i, 0), b.es, dst.cols);
+        }
+        mat_blas(dst, x, 0, w, 0, 1.f, 1.f);
+        for (size_t i = 0; i < dst.rows; ++i) {
+            nn_span_act(&MAT_AT(dst, i, 0), dst.cols, act);
+        }
+#else
+        mat_gemm(dst, x, 0, w, 0, 1.f, 0.f, b.es, act, scratch);
+#endif // NN_SGEMM
+    } else {
+        for (size_t i = 0; i < dst.rows; ++i) {
+            float *d = &MAT_AT(dst, i, 0);
+            nn_span_copy(d, b.es, dst.cols);
+            for (size_t k = 0; k < x.cols; ++k) {
+                nn_span_axpy(d, &MAT_AT(w, k, 0), dst.cols, MAT_AT(x, i, k));
+            }
+            nn_span_act(d, dst.cols, act);
+        }
+    }
+    NN_PROF_END(NN_PROF_DENSE, 2*dst.rows*dst.cols*x.cols + 2*dst.rows*dst.cols, mat_dot_bytes(dst, x.cols));
+}
+
+// Any other act than sigmoidf runs as a separate pass after the fused kernel
+inline void mat_dense(Mat dst, Mat x, Mat w, Mat b, float (*act)(float))
+{
+    mat_dense_scratch(dst, x, w, b, act == sigmoidf ? NN_ACT_SIG : NN_ACT_NONE, NULL);
+    if (act && act != sigmoidf) {
+        for (size_t i = 0; i < dst.rows; ++i) {
+            for (size_t j = 0; j < dst.cols; ++j) {
+                MAT_AT(dst, i, j) = act(MAT_AT(dst, i, j));
+            }
+        }
+    }
+}
+
+inline void mat_dense_sig(Mat dst, Mat x, Mat w, Mat b)
+{
+    mat_dense_scratch(dst, x, w, b, NN_ACT_SIG, NULL);
+}
+
+inline void mat_dense_act(Mat dst, Mat x, Mat w, Mat b, NN_Act act)
+{
+    mat_dense_scratch(dst, x, w, b, act, NULL);
+}
+
+inline uint16_t nn_half_from_float(NN_Half type, float x)
+{
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    if (type == NN_BF16) {
+        if ((u & 0x7fffffffu) > 0x7f800000u) return (uint16_t)((u >> 16) | 0x40); // Quiet NaN
+        return (uint16_t)((u + 0x7fffu + ((u >> 16) & 1)) >> 16);
+    }
+
+    uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+    u &= 0x7fffffffu;
+    if (u >= 0x7f800000u) return sign | 0x7c00 | (u > 0x7f800000u ? 0x200 : 0); // Inf, NaN
+    if (u >= 0x477ff000u) return sign | 0x7c00;                                  // Overflows
+    if (u < 0x38800000u) {                       // Subnormal: exact multiple of 2^-24, rounded
+        return sign | (uint16_t)lrintf(fabsf(x)*0x1p24f);
+    }
+    // Rebias the exponent from 127 to 15 and round the 13 dropped bits to nearest even
+    return sign | (uint16_t)((u - 0x38000000u + 0xfffu + ((u >> 13) & 1)) >> 13);
+}
+
+inline float nn_half_to_float(NN_Half type, uint16_t h)
+{
+    uint32_t u;
+    if (type == NN_BF16) {
+        u = (uint32_t)h << 16;
+    } else {
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f, man = h & 0x3ff;
+        if (exp == 0) {
+            float f = (float)man*0x1p-24f;
+            return sign ? -f : f;
+        }
+        u = sign | (exp == 0x1f ? 0x7f800000u : (exp + 112) << 23) | (man << 13);
+    }
+    float x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+inline Mat16 mat16_alloc(size_t rows, size_t cols, NN_Half type)
+{
+    Mat16 m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.type = type;
+    m.es = nn_mem_alloc(sizeof(*m.es)*rows*cols);
+    NN_ASSERT(m.es != NULL);
+    return m;
+}
+
+inline void mat16_free(Mat16 *m)
+{
+    if (m->es) {
+        nn_mem_free(m->es);
+    }
+    m->es = NULL;
+    m->rows = m->cols = m->stride = 0;
+}
+
+inline void mat16_from_mat(Mat16 dst, Mat src)
+{
+    NN_ASSERT(dst.rows == src.rows);
+    NN_ASSERT(dst.cols == src.cols);
+    for (size_t i = 0; i < dst.rows; ++i) {
+        for (size_t j = 0; j < dst.cols; ++j) {
+            dst.es[i*dst.stride + j] = nn_half_from_float(dst.type, MAT_AT(src, i, j));
+        }
+    }
+}
+
+inline void mat16_to_mat(Mat dst, Mat16 src)
+{
+    NN_ASSERT(dst.rows == src.rows);
+    NN_ASSERT(dst.cols == src.cols);
+    for (size_t i = 0; i < dst.rows; ++i) {
+        const uint16_t *s = src.es + i*src.stride;
+        float *d = &MAT_AT(dst, i, 0);
+        if (src.type == NN_BF16) {
+            for (size_t j = 0; j < dst.cols; ++j) {
+                uint32_t u = (uint32_t)s[j] << 16; // Vectorizes, unlike the fp16 branches
+                memcpy(&d[j], &u, sizeof(u));
+            }
+        } else {
+            for (size_t j = 0; j < dst.cols; ++j) d[j] = nn_half_to_float(NN_FP16, s[j]);
+        }
+    }
+}
+
+// The float panel of NN_GEMM_KC rows of b, followed by the packing space of its product
+inline size_t mat_dot16_scratch(size_t m, size_t n, size_t k)
+{
+    size_t kc = k < NN_GEMM_KC ? k : NN_GEMM_KC;
+    return kc*n + mat_gemm_scratch(m, n, kc);
+}
+
+// b is widened NN_GEMM_KC rows at a time into a float panel that the regular product consumes,
+// so the products and sums stay in fp32 and only the panel lives in float at once.
+inline void mat_dot16(Mat dst, Mat a, Mat16 b, float *scratch)
+{
+    NN_ASSERT(a.cols == b.rows);
+    NN_ASSERT(dst.rows == a.rows);
+    NN_ASSERT(dst.cols == b.cols);
+
+    float *es = scratch;
+    if (!es) {
+        es = nn_mem_alloc(sizeof(float)*mat_dot16_scratch(dst.rows, dst.cols, a.cols));
+        NN_ASSERT(es != NULL);
+    }
+    size_t kc = b.rows < NN_GEMM_KC ? b.rows : NN_GEMM_KC;
+    Mat panel = { .rows = kc, .cols = b.cols, .stride = b.cols, .es = es };
+    for (size_t pc = 0; pc < b.rows; pc += kc) {
+        size_t k = b.rows - pc < kc ? b.rows - pc : kc;
+        Mat16 rows = b;
+        rows.rows = k;
+        rows.es = b.es + pc*b.stride;
+        Mat wide = mat_rows(panel, 0, k);
+        mat16_to_mat(wide, rows);
+        mat_dot_scratch(dst, mat_cols(a, pc, k), 0, wide, 0, 1.f, 1.f, es + kc*b.cols);
+    }
+    if (!scratch) nn_mem_free(es);
+}
+
+inline void mat_print(Mat m, const char *name)
+{
+    printf("%s = [\n", name);
+    for (size_t i = 0; i < m.rows; ++i) {
+        for (size_t j = 0; j < m.cols; ++j) {
+            printf("    %f ", MAT_AT(m, i, j));
+        }
+        printf("\n");
+    }
+    printf("]\n");
+}
+
+inline void mat_rand(Mat m, NN_Rng *rng, float low, float high)
+{
+    if (m.stride == m.cols) {
+        nn_rng_fill(rng, m.es, m.rows*m.cols, low, high);
+        return;
+    }
+    for (size_t i = 0; i < m.rows; ++i) {
+        nn_rng_fill(rng, &MAT_AT(m, i, 0), m.cols, low, high);
+    }
+}
+
+inline void mat_xavier_init(Mat m, NN_Rng *rng, size_t inputs, size_t outputs)
+{
+    float limit = sqrtf(6.f/(float)(inputs + outputs));
+    mat_rand(m, rng, -limit, limit);
+}
+
+// Fisher-Yates over the rows, e.g. to reshuffle training data between epochs. Shuffling a
+// view with features and labels side by side (like td) keeps the pairs together.
+inline void mat_shuffle_rows(Mat m, NN_Rng *rng)
+{
+    for (size_t i = m.rows; i > 1; --i) {
+        size_t j = (size_t)(((uint64_t)nn_rng_u32(rng)*(uint64_t)i) >> 32);
+        if (j == i - 1) continue;
+        for (size_t k = 0; k < m.cols; ++k) {
+            float t = MAT_AT(m, i - 1, k);
+            MAT_AT(m, i - 1, k) = MAT_AT(m, j, k);
+            MAT_AT(m, j, k) = t;
+        }
+    }
+}
+
+inline Mat mat_row(Mat m, size_t row)
+{
+    return (Mat){
+        .rows = 1,
+        .cols = m.cols,
+        .stride = m.stride,
+        .es = &MAT_AT(m, row, 0)
+    };
+}
+
+inline Mat mat_rows(Mat m, size_t row, size_t count)
+{
+    NN_ASSERT(row + count <= m.rows);
+    return (Mat){
+        .rows = count,
+        .cols = m.cols,
+        .stride = m.stride,
+        .es = &MAT_AT(m, row, 0)
+    };
+}
+
+inline Mat mat_cols(Mat m, size_t col, size_t count)
+{
+    NN_ASSERT(col + count <= m.cols);
+    return (Mat){
+        .rows = m.rows,
+        .cols = count,
+        .stride = m.stride,
+        .es = &MAT_AT(m, 0, col)
+    };
+}
+
+inline void mat_copy(Mat dst, Mat src)
+{
+    NN_ASSERT(dst.rows == src.rows);
+    NN_ASSERT(dst.cols == src.cols);
+    NN_PROF_BEGIN();
+    if (dst.stride == dst.cols && src.stride == src.cols) {
+        nn_span_copy(dst.es, src.es, dst.rows*dst.cols);
+    } else {
+        for (size_t i = 0; i < dst.rows; ++i) {
+            nn_span_copy(&MAT_AT(dst, i, 0), &MAT_AT(src, i, 0), dst.cols);
+        }
+    }
+    NN_PROF_END(NN_PROF_COPY, 0, 2*sizeof(float)*dst.rows*dst.cols);
+}
+
+// Lays out an NN in one arena: Mat headers, then the parameters (unless ps points at external
+// storage the NN does not own, as for nn_load), then the activations and the layer activations.
+// Sizes derived from an architecture, which may come from a file: an overflow fails the
+// assertion, and without assertions saturates so the allocation fails instead of coming back short
+static inline size_t nn_size_mul(size_t a, size_t b)
+{
+    int ok = b == 0 || a <= SIZE_MAX/b;
+    NN_ASSERT(ok && "size overflow");
+    return ok ? a*b : SIZE_MAX;
+}
+
+static inline size_t nn_size_add(size_t a, size_t b)
+{
+    int ok = a <= SIZE_MAX - b;
+    NN_ASSERT(ok && "size overflow");
+    return ok ? a + b : SIZE_MAX;
+}
+
+static inline NN nn_alloc_layout(size_t *arch, size_t arch_count, size_t batch, float *ps)
+{
+    NN_ASSERT(arch_count > 1);
+
+    NN nn;
+    nn.count = arch_count - 1;
+
+    // The packing space covers each layer's forward product, its weight gradient (k = batch)
+    // and the delta of the layer below, so training and nn_cost never allocate per call
+    size_t ps_count = 0, as_count = arch[0], width = 0, pack = 0;
+    for (size_t i = 1; i < arch_count; ++i) {
+        size_t layer = nn_size_add(nn_size_mul(arch[i-1], arch[i]), arch[i]);
+        ps_count = nn_size_add(ps_count, layer);
+        as_count = nn_size_add(as_count, arch[i]);
+        if (arch[i] > width) width = arch[i];
+        if (batch > 0) {
+            size_t fwd = mat_gemm_scratch(batch, arch[i], arch[i-1]);
+            size_t grad = mat_gemm_scratch(arch[i-1], arch[i], batch);
+            size_t delta = mat_gemm_scratch(batch, arch[i-1], arch[i]);
+            if (fwd > pack) pack = fwd;
+            if (grad > pack) pack = grad;
+            if (delta > pack) pack = delta;
+        }
+    }
+    as_count = nn_size_add(nn_size_mul(batch, nn_size_add(as_count, width)), pack);
+
+    // The headers are padded so the parameters and the activations start NN_ALIGN-aligned
+    size_t mats = 3*nn.count + 1;
+    size_t head = (sizeof(Mat)*mats + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN;
+    size_t owned = ps ? 0 : nn_size_add(nn_size_mul(ps_count, sizeof(float)), NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN/sizeof(float);
+    size_t bytes = nn_size_mul(sizeof(float), nn_size_add(owned, as_count));
+    bytes = nn_size_add(nn_size_add(bytes, head), sizeof(NN_Act)*nn.count);
+    char *arena = nn_mem_alloc(bytes);
+    NN_ASSERT(arena != NULL);
+
+    nn.ws = (Mat*)arena;
+    nn.bs = nn.ws + nn.count;
+    nn.as = nn.bs + nn.count;
+    nn.ps = ps ? ps : (float*)(arena + head);
+    nn.ps_count = ps_count;
+    nn.arena = arena;
+
+    float *p = nn.ps;
+    float *a = (float*)(arena + head) + owned;
+    nn.as[0] = (Mat){ .rows = batch, .cols = arch[0], .stride = arch[0], .es = a };
+    a += batch*arch[0];
+    for (size_t i = 1; i < arch_count; ++i) {
+        nn.ws[i-1] = (Mat){ .rows = arch[i-1], .cols = arch[i], .stride = arch[i], .es = p };
+        p += arch[i-1]*arch[i];
+        nn.bs[i-1] = (Mat){ .rows = 1, .cols = arch[i], .stride = arch[i], .es = p };
+        p += arch[i];
+        nn.as[i] = (Mat){ .rows = batch, .cols = arch[i], .stride = arch[i], .es = a };
+        a += batch*arch[i];
+    }
+    nn.ds = batch ? a : NULL;
+    a += batch*width;
+    nn.pack = batch ? a : NULL;
+    a += pack;
+    nn.acts = (NN_Act*)a;
+    nn_set_act(nn, NN_ACT_SIG, NN_ACT_SIG);
+
+    return nn;
+}
+
+inline NN nn_alloc(size_t *arch, size_t arch_count, size_t batch)
+{
+    return nn_alloc_layout(arch, arch_count, batch, NULL);
+}
+
+// nn's architecture and activations at another batch size, over its own parameters, or over
+// ps when that is not NULL
+static inline NN nn_alloc_shape(NN nn, size_t batch, float *ps)
+{
+    size_t *arch = nn_mem_alloc(sizeof(*arch)*(nn.count + 1));
+    NN_ASSERT(arch != NULL);
+    arch[0] = NN_INPUT(nn).cols;
+    for (size_t i = 0; i < nn.count; ++i) {
+        arch[i+1] = nn.ws[i].cols;
+    }
+    NN r = nn_alloc_layout(arch, nn.count + 1, batch, ps);
+    memcpy(r.acts, nn.acts, sizeof(*r.acts)*nn.count);
+    nn_mem_free(arch);
+    return r;
+}
+
+inline NN nn_alloc_like(NN nn)
+{
+    return nn_alloc_shape(nn, NN_INPUT(nn).rows, NULL);
+}
+
+inline NN nn_alloc_grad(NN nn)
+{
+    return nn_alloc_shape(nn, 0, NULL);
+}
+
+inline void nn_free(NN *nn)
+{
+    if (nn->arena) {
+        nn_mem_free(nn->arena);
+    }
+    nn->arena = NULL;
+    nn->ws = nn->bs = nn->as = NULL;
+    nn->ds = NULL;
+    nn->acts = NULL;
+    nn->ps = NULL;
+    nn->count = nn->ps_count = 0;
+}
+
+// Every layer but the last gets hidden, the output layer gets output
+inline void nn_set_act(NN nn, NN_Act hidden, NN_Act output)
+{
+    for (size_t i = 0; i < nn.count; ++i) {
+        nn.acts[i] = i + 1 < nn.count ? hidden : output;
+    }
+}
+
+inline void nn_zero(NN nn)
+{
+    nn_span_fill(nn.ps, nn.ps_count, 0);
+    for (size_t i = 0; i <= nn.count; ++i) {
+        mat_fill(nn.as[i], 0);
+    }
+}
+
+// Xavier initialisation for the weights (reduces variance when training), small uniform biases
+inline void nn_xavier_init(NN nn, NN_Rng *rng)
+{
+    for (size_t i = 0; i < nn.count; ++i) {
+        mat_xavier_init(nn.ws[i], rng, nn.ws[i].rows, nn.ws[i].cols);
+        mat_rand(nn.bs[i], rng, -0.5f, 0.5f);
+    }
+}
+
+inline void nn_print(NN nn, const char *name)
+{
+    char buf[256];
+    printf("%s = [\n", name);
+    for (size_t i = 0; i < nn.count; ++i) {
+        snprintf(buf, sizeof(buf), "ws%zu", i);
+        mat_print(nn.ws[i], buf);
+        snprintf(buf, sizeof(buf), "bs%zu", i);
+        mat_print(nn.bs[i], buf);
+    }
+    printf("]\n");
+}
+
+inline void nn_forward(NN nn)
+{
+    nn_forward_batch(nn, NN_INPUT(nn));
+}
+
+// Forwards up to batch rows of x at once. x is read in place (e.g. a mat_rows view into
+// the training data), the results land in the first x.rows rows of every activation.
+inline void nn_forward_batch(NN nn, Mat x)
+{
+    nn_forward_from(nn, x, 0);
+}
+
+inline void nn_forward_from(NN nn, Mat x, size_t layer)
+{
+    NN_ASSERT(x.cols == NN_INPUT(nn).cols);
+    NN_ASSERT(x.rows <= NN_INPUT(nn).rows);
+    NN_ASSERT(layer < nn.count);
+
+    Mat in = layer > 0 ? mat_rows(nn.as[layer], 0, x.rows) : x;
+    for (size_t i = layer; i < nn.count; ++i) {
+        Mat out = mat_rows(nn.as[i+1], 0, x.rows);
+        mat_dense_scratch(out, in, nn.ws[i], nn.bs[i], nn.acts[i], nn.pack);
+        in = out;
+    }
+}
+
+inline size_t nn_param_layer(NN nn, size_t p)
+{
+    NN_ASSERT(p < nn.ps_count);
+    size_t l = 0;
+    while (nn.bs[l].es + nn.bs[l].cols <= nn.ps + p) ++l; // layers are laid out in order
+    return l;
+}
+
+// Squared errors of the last forward pass over a slice with the targets to; the residuals go
+// to nn.ds and are reduced with nn_dot
+static inline float nn_slice_cost(NN nn, Mat to)
+{
+    Mat e = { .rows = to.rows, .cols = to.cols, .stride = to.cols, .es = nn.ds };
+    for (size_t k = 0; k < to.rows; ++k) {
+        for (size_t j = 0; j < to.cols; ++j) {
+            MAT_AT(e, k, j) = MAT_AT(NN_OUTPUT(nn), k, j) - MAT_AT(to, k, j);
+        }
+    }
+    return nn_dot(e.es, e.es, to.rows*to.cols);
+}
+
+// Sum of the squared errors over the rows of ti/to; the slice sums are Kahan-compensated, so
+// long datasets do not drift
+static inline float nn_cost_sum(NN nn, Mat ti, Mat to)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(to.cols == NN_OUTPUT(nn).cols);
+    NN_ASSERT(ti.cols == NN_INPUT(nn).cols);
+    size_t n = ti.rows;
+    size_t batch = NN_INPUT(nn).rows;
+    NN_ASSERT(batch > 0);
+    float c = 0, ce = 0;
+
+    for (size_t i = 0; i < n; i += batch) {
+        size_t r = n - i < batch ? n - i : batch;
+        nn_forward_batch(nn, mat_rows(ti, i, r));
+        nn_kahan_add(&c, &ce, nn_slice_cost(nn, mat_rows(to, i, r)));
+    }
+    return c;
+}
+
+inline float nn_cost(NN nn, Mat ti, Mat to) // training input, training output
+{
+    return ti.rows ? nn_cost_sum(nn, ti, to)/(float)ti.rows : 0.f;
+}
+
+// Squared errors of the slice x/to with *p moved by delta, re-evaluated from layer l upwards
+static inline float nn_slice_cost_perturbed(NN nn, Mat x, Mat to, size_t l, float *p, float delta)
+{
+    float saved = *p;
+    *p = saved + delta;
+    nn_forward_from(nn, x, l);
+    float c = nn_slice_cost(nn, to);
+    *p = saved;
+    return c;
+}
+
+// Forward difference approximation of the gradient. Costs a forward pass per parameter, from
+// the parameter's layer upwards, so it is only useful for checking nn_backprop. Each slice is
+// forwarded once, and the parameters are perturbed last layer first over its cached activations.
+inline void nn_finite_diff(NN nn, NN g, float eps, Mat ti, Mat to)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(g.ps_count == nn.ps_count);
+    size_t n = ti.rows;
+    size_t batch = NN_INPUT(nn).rows;
+    NN_ASSERT(batch > 0);
+    nn_zero(g);
+
+    for (size_t i = 0; i < n; i += batch) {
+        size_t r = n - i < batch ? n - i : batch;
+        Mat x = mat_rows(ti, i, r), t = mat_rows(to, i, r);
+        nn_forward_batch(nn, x);
+        float c = nn_slice_cost(nn, t);
+
+        for (size_t l = nn.count; l-- > 0;) {
+            for (size_t j = 0; j < nn.ws[l].rows; ++j) {
+                for (size_t k = 0; k < nn.ws[l].cols; ++k) {
+                    MAT_AT(g.ws[l], j, k) += nn_slice_cost_perturbed(nn, x, t, l, &MAT_AT(nn.ws[l], j, k), eps) - c;
+                }
+            }
+            for (size_t k = 0; k < nn.bs[l].cols; ++k) {
+                MAT_AT(g.bs[l], 0, k) += nn_slice_cost_perturbed(nn, x, t, l, &MAT_AT(nn.bs[l], 0, k), eps) - c;
+            }
+        }
+    }
+    if (n > 0) nn_span_scale(g.ps, g.ps_count, 1.f/((float)n*eps));
+}
+
+// Reverse-mode gradient of nn_cost: one batched forward and one batched backward pass per
+// slice of training data. g only needs nn's parameter shape (nn_alloc_grad). The derivatives
+// come from the cached activations, except for GELU layers, whose pre-activations are
+// recomputed over their activations. Once a layer's activations are used up, dC/dz of that
+// layer overwrites them, and nn.ds carries dC/dy down to the layer below: the backward pass
+// needs no buffers of its own, and nn's activations hold the deltas afterwards.
+// The squared errors are summed on the way, so the cost of nn comes out for free.
+// nn_backprop_sum returns that sum and takes the scale of the output delta: 2/n gives the
+// gradient of the mean, 2/N the share of n rows in the mean over N (nn_backprop_parallel).
+static inline float nn_backprop_sum(NN nn, NN g, Mat ti, Mat to, float scale)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(to.cols == NN_OUTPUT(nn).cols);
+    NN_ASSERT(ti.cols == NN_INPUT(nn).cols);
+    NN_ASSERT(g.ps_count == nn.ps_count);
+    size_t n = ti.rows;
+    size_t batch = NN_INPUT(nn).rows;
+    NN_ASSERT(batch > 0);
+    float c = 0, ce = 0;
+    NN_PROF_BEGIN();
+
+    // The first slice overwrites the weight gradients, so only the bias sums (and everything,
+    // when there is no slice at all) start from zero
+    if (n == 0) {
+        nn_zero(g);
+    }
+    for (size_t l = 0; l < g.count; ++l) {
+        mat_fill(g.bs[l], 0);
+    }
+
+    for (size_t i = 0; i < n; i += batch) {
+        size_t r = n - i < batch ? n - i : batch;
+        Mat x = mat_rows(ti, i, r);
+        nn_forward_batch(nn, x);
+
+        Mat out = mat_rows(NN_OUTPUT(nn), 0, r);
+        Mat dy = { .rows = r, .cols = out.cols, .stride = out.cols, .es = nn.ds };
+        for (size_t k = 0; k < r; ++k) {
+            for (size_t j = 0; j < to.cols; ++j) {
+                MAT_AT(dy, k, j) = MAT_AT(out, k, j) - MAT_AT(to, i + k, j);
+            }
+        }
+        nn_kahan_add(&c, &ce, nn_dot(dy.es, dy.es, r*dy.cols));
+        nn_span_scale(dy.es, r*dy.cols, scale);
+
+        for (size_t l = nn.count; l > 0; --l) {
+            Mat a = mat_rows(nn.as[l], 0, r);
+            Mat in = l > 1 ? mat_rows(nn.as[l-1], 0, r) : x;
+            if (nn.acts[l-1] == NN_ACT_GELU) {
+                mat_dense_scratch(a, in, nn.ws[l-1], nn.bs[l-1], NN_ACT_NONE, nn.pack); // a = z
+            }
+            for (size_t k = 0; k < r; ++k) {
+                float *d = &MAT_AT(dy, k, 0), *ak = &MAT_AT(a, k, 0);
+                nn_span_act_grad(d, ak, a.cols, nn.acts[l-1]);
+                nn_span_copy(ak, d, a.cols); // a = dC/dz
+                nn_span_add(g.bs[l-1].es, ak, a.cols);
+            }
+
+            mat_dot_scratch(g.ws[l-1], in, 1, a, 0, 1.f, i == 0 ? 0.f : 1.f, nn.pack);
+
+            if (l > 1) {
+                dy = (Mat){ .rows = r, .cols = in.cols, .stride = in.cols, .es = nn.ds };
+                mat_dot_scratch(dy, a, 0, nn.ws[l-1], 1, 1.f, 0.f, nn.pack);
+            }
+        }
+    }
+
+#ifdef NN_PROFILE
+    // Forward 2, backward 4 flops per weight and row; the parameters and gradient are read
+    // or written once per slice, the activations three times per row
+    size_t width = 0, slices = (n + batch - 1)/batch;
+    for (size_t l = 0; l <= nn.count; ++l) width += nn.as[l].cols;
+    NN_PROF_END(NN_PROF_BACKPROP, 6*n*nn.ps_count,
+                sizeof(float)*(3*slices*nn.ps_count + 3*n*width));
+#endif
+    return c;
+}
+
+inline float nn_backprop(NN nn, NN g, Mat ti, Mat to)
+{
+    size_t n = ti.rows;
+    float c = nn_backprop_sum(nn, g, ti, to, n ? 2.f/(float)n : 0.f);
+    return n ? c/(float)n : 0.f;
+}
+
+// Both models share the same layout, so the update is a single pass over the flat parameters
+inline void nn_learn(NN nn, NN g, float rate)
+{
+    NN_ASSERT(nn.ps_count == g.ps_count);
+    NN_PROF_BEGIN();
+    nn_span_axpy(nn.ps, g.ps, nn.ps_count, -rate);
+    NN_PROF_END(NN_PROF_LEARN, 2*nn.ps_count, 3*sizeof(float)*nn.ps_count);
+}
+
+// v = mu*v + g, then p -= rate*v, or p -= rate*(g + mu*v) for Nesterov
+static inline void nn_span_momentum(float *p, float *v, const float *g, size_t n,
+                                    float rate, float mu, int nesterov)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf vmu = nn_vf_set1(mu), vrate = nn_vf_set1(-rate);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) {
+        nn_vf gi = nn_vf_load(g + i);
+        nn_vf vi = nn_vf_fma(vmu, nn_vf_load(v + i), gi);
+        nn_vf step = nesterov ? nn_vf_fma(vmu, vi, gi) : vi;
+        nn_vf_store(v + i, vi);
+        nn_vf_store(p + i, nn_vf_fma(vrate, step, nn_vf_load(p + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        v[i] = mu*v[i] + g[i];
+        p[i] -= rate*(nesterov ? g[i] + mu*v[i] : v[i]);
+    }
+}
+
+// m = b1*m + (1 - b1)*g, v = b2*v + (1 - b2)*g^2, p -= rate*m/(sqrt(v) + eps). The bias
+// corrections are folded into rate and eps by the caller, so the loop has no per-step powers.
+static inline void nn_span_adam(float *p, float *m, float *v, const float *g, size_t n,
+                                float rate, float b1, float b2, float eps)
+{
+    size_t i = 0;
+#if NN_SIMD_W > 1
+    nn_vf vb1 = nn_vf_set1(b1), vc1 = nn_vf_set1(1.f - b1);
+    nn_vf vb2 = nn_vf_set1(b2), vc2 = nn_vf_set1(1.f - b2);
+    nn_vf vrate = nn_vf_set1(-rate), veps = nn_vf_set1(eps);
+    for (; i + NN_SIMD_W <= n; i += NN_SIMD_W) {
+        nn_vf gi = nn_vf_load(g + i);
+        nn_vf mi = nn_vf_fma(vb1, nn_vf_load(m + i), nn_vf_mul(vc1, gi));
+        nn_vf vi = nn_vf_fma(vb2, nn_vf_load(v + i), nn_vf_mul(vc2, nn_vf_mul(gi, gi)));
+        nn_vf_store(m + i, mi);
+        nn_vf_store(v + i, vi);
+        nn_vf step = nn_vf_div(mi, nn_vf_add(nn_vf_sqrt(vi), veps));
+        nn_vf_store(p + i, nn_vf_fma(vrate, step, nn_vf_load(p + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        m[i] = b1*m[i] + (1.f - b1)*g[i];
+        v[i] = b2*v[i] + (1.f - b2)*g[i]*g[i];
+        p[i] -= rate*m[i]/(sqrtf(v[i]) + eps);
+    }
+}
+
+inline NN_Opt nn_opt_alloc(NN nn, NN_OptKind kind, float rate)
+{
+    NN_Opt opt = {
+        .kind = kind, .rate = rate, .beta1 = 0.9f, .beta2 = 0.999f, .eps = 1e-8f,
+        .count = nn.ps_count,
+    };
+    size_t buffers = kind == NN_OPT_ADAM ? 2 : kind == NN_OPT_SGD ? 0 : 1;
+    if (buffers > 0) {
+        float *es = nn_mem_alloc(sizeof(float)*buffers*nn.ps_count);
+        NN_ASSERT(es != NULL);
+        opt.m = es;
+        opt.v = buffers > 1 ? es + nn.ps_count : NULL;
+        opt.arena = es;
+    }
+    nn_opt_reset(&opt);
+    return opt;
+}
+
+inline void nn_opt_free(NN_Opt *opt)
+{
+    if (opt->arena) {
+        nn_mem_free(opt->arena);
+    }
+    opt->arena = NULL;
+    opt->m = opt->v = NULL;
+    opt->count = opt->t = 0;
+}
+
+// Clears the optimizer state, e.g. before training the same model again from a new start
+inline void nn_opt_reset(NN_Opt *opt)
+{
+    opt->t = 0;
+    if (opt->m) nn_span_fill(opt->m, opt->count, 0);
+    if (opt->v) nn_span_fill(opt->v, opt->count, 0);
+}
+
+inline void nn_opt_step(NN_Opt *opt, NN nn, NN g)
+{
+    NN_ASSERT(nn.ps_count == g.ps_count);
+    NN_ASSERT(nn.ps_count == opt->count);
+    NN_PROF_BEGIN();
+    switch (opt->kind) {
+    case NN_OPT_SGD:
+        nn_span_axpy(nn.ps, g.ps, nn.ps_count, -opt->rate);
+        break;
+    case NN_OPT_MOMENTUM:
+    case NN_OPT_NESTEROV:
+        nn_span_momentum(nn.ps, opt->m, g.ps, nn.ps_count, opt->rate, opt->beta1,
+                         opt->kind == NN_OPT_NESTEROV);
+        break;
+    case NN_OPT_ADAM: {
+        opt->t += 1;
+        float c1 = 1.f - powf(opt->beta1, (float)opt->t);
+        float c2 = sqrtf(1.f - powf(opt->beta2, (float)opt->t));
+        nn_span_adam(nn.ps, opt->m, opt->v, g.ps, nn.ps_count,
+                     opt->rate*c2/c1, opt->beta1, opt->beta2, opt->eps*c2);
+        break;
+    }
+    }
+#ifdef NN_PROFILE
+    // Per parameter: p, g and each state buffer are read, p and the state written back
+    size_t buffers = opt->kind == NN_OPT_ADAM ? 2 : opt->kind == NN_OPT_SGD ? 0 : 1;
+    size_t flops = opt->kind == NN_OPT_ADAM ? 10 : opt->kind == NN_OPT_SGD ? 2 : 4;
+    NN_PROF_END(NN_PROF_OPT, flops*nn.ps_count, sizeof(float)*(3 + 2*buffers)*nn.ps_count);
+#endif
+}
+
+// Compile-time specialised I-H-O network: NN_FIXED(Xor221, 2, 2, 1, NN_ACT_SIG, NN_ACT_SIG)
+// defines a plain struct Xor221 holding w1, b1, w2, b2 inline (no pointers, same order and
+// layout as the ps of an NN with arch {I, H, O}) and
+//
+//     void  Xor221_infer(const Xor221 *m, const float *x, float *y)  one sample, I in, O out
+//     float Xor221_cost(const Xor221 *m, Mat ti, Mat to)
+//     void  Xor221_backprop(const Xor221 *m, Xor221 *g, Mat ti, Mat to)  g = dC/dparams
+//     void  Xor221_learn(Xor221 *m, const Xor221 *g, float rate)
+//     void  Xor221_from_nn(Xor221 *m, NN nn) / Xor221_to_nn(const Xor221 *m, NN nn)
+//
+// Every loop has constant bounds and is unrolled, there are no shape checks or strides inside
+// a sample and the activations fold to straight-line code, which is what pays off for tiny
+// models. Use it after the NN_IMPLEMENTATION include, whose inline kernels it builds on.
+#if defined(__clang__)
+#define NN_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define NN_UNROLL _Pragma("GCC unroll 64")
+#else
+#define NN_UNROLL
+#endif
+
+#define NN_FIXED(name, I, H, O, HACT, OACT)                                                      \
+typedef struct {                                                                                \
+    float w1[I][H];                                                                             \
+    float b1[H];                                                                                \
+    float w2[H][O];                                                                             \
+    float b2[O];                                                                                \
+} name;                                                                                         \
+                                                                                                \
+static inline void name##_forward(const name *m, const float *x,                                \
+                                  float *z1, float *h, float *z2, float *y)                     \
+{                                                                                               \
+    NN_UNROLL for (size_t j = 0; j < (H); ++j) {                                                \
+        float z = m->b1[j];                                                                     \
+        NN_UNROLL for (size_t k = 0; k < (I); ++k) z += x[k]*m->w1[k][j];                       \
+        z1[j] = z;                                                                              \
+        h[j] = nn_act(HACT, z);                                                                 \
+    }                                                                                           \
+    NN_UNROLL for (size_t o = 0; o < (O); ++o) {                                                \
+        float z = m->b2[o];                                                                     \
+        NN_UNROLL for (size_t j = 0; j < (H); ++j) z += h[j]*m->w2[j][o];                       \
+        z2[o] = z;                                                                              \
+        y[o] = nn_act(OACT, z);                                                                 \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline void name##_infer(const name *m, const float *x, float *y)                        \
+{                                                                                               \
+    float z1[H], h[H], z2[O];                                                                   \
+    name##_forward(m, x, z1, h, z2, y);                                                         \
+}                                                                                               \
+                                                                                                \
+static inline float name##_cost(const name *m, Mat ti, Mat to)                                  \
+{                                                                                               \
+    NN_ASSERT(ti.cols == (I) && to.cols == (O) && ti.rows == to.rows);                          \
+    float c = 0;                                                                                \
+    for (size_t r = 0; r < ti.rows; ++r) {                                                      \
+        float y[O];                                                                             \
+        name##_infer(m, &MAT_AT(ti, r, 0), y);                                                  \
+        NN_UNROLL for (size_t o = 0; o < (O); ++o) {                                            \
+            float d = y[o] - MAT_AT(to, r, o);                                                  \
+            c += d*d;                                                                           \
+        }                                                                                       \
+    }                                                                                           \
+    return c/(float)ti.rows;                                                                    \
+}                                                                                               \
+                                                                                                \
+static inline void name##_backprop(const name *m, name *g, Mat ti, Mat to)                      \
+{                                                                                               \
+    NN_ASSERT(ti.cols == (I) && to.cols == (O) && ti.rows == to.rows);                          \
+    memset(g, 0, sizeof(*g));                                                                   \
+    float s = 2.f/(float)ti.rows;                                                               \
+    for (size_t r = 0; r < ti.rows; ++r) {                                                      \
+        const float *x = &MAT_AT(ti, r, 0);                                                     \
+        float z1[H], h[H], z2[O], y[O], d2[O];                                                  \
+        name##_forward(m, x, z1, h, z2, y);                                                     \
+        NN_UNROLL for (size_t o = 0; o < (O); ++o) {                                            \
+            float a = (OACT) == NN_ACT_GELU ? z2[o] : y[o];                                     \
+            d2[o] = s*(y[o] - MAT_AT(to, r, o))*nn_act_grad(OACT, a);                           \
+            g->b2[o] += d2[o];                                                                  \
+        }                                                                                       \
+        NN_UNROLL for (size_t j = 0; j < (H); ++j) {                                            \
+            float e = 0;                                                                        \
+            NN_UNROLL for (size_t o = 0; o < (O); ++o) {                                        \
+                g->w2[j][o] += h[j]*d2[o];                                                      \
+                e += m->w2[j][o]*d2[o];                                                         \
+            }                                                                                   \
+            float d1 = e*nn_act_grad(HACT, (HACT) == NN_ACT_GELU ? z1[j] : h[j]);               \
+            g->b1[j] += d1;                                                                     \
+            NN_UNROLL for (size_t k = 0; k < (I); ++k) g->w1[k][j] += x[k]*d1;                  \
+        }                                                                                       \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline void name##_learn(name *m, const name *g, float rate)                             \
+{                                                                                               \
+    float *p = (float*)m;                                                                       \
+    const float *d = (const float*)g;                                                           \
+    NN_UNROLL for (size_t i = 0; i < sizeof(*m)/sizeof(float); ++i) p[i] -= rate*d[i];          \
+}                                                                                               \
+                                                                                                \
+static inline void name##_check_nn(NN nn)                                                       \
+{                                                                                               \
+    NN_ASSERT(nn.count == 2);                                                                   \
+    NN_ASSERT(nn.ws[0].rows == (I) && nn.ws[0].cols == (H) && nn.ws[1].cols == (O));            \
+    NN_ASSERT(nn.ps_count*sizeof(float) == sizeof(name));                                       \
+    (void) nn;                                                                                  \
+}                                                                                               \
+                                                                                                \
+static inline void name##_from_nn(name *m, NN nn)                                               \
+{                                                                                               \
+    name##_check_nn(nn);                                                                        \
+    memcpy(m, nn.ps, sizeof(*m));                                                               \
+}                                                                                               \
+                                                                                                \
+static inline void name##_to_nn(const name *m, NN nn)                                           \
+{                                                                                               \
+    name##_check_nn(nn);                                                                        \
+    memcpy(nn.ps, m, sizeof(*m));                                                               \
+}
+
+inline NN_Workspace nn_workspace_alloc(const NN *nn, size_t batch)
+{
+    NN_ASSERT(batch > 0);
+    size_t width = 0, pack = 0;
+    for (size_t i = 0; i < nn->count; ++i) {
+        if (i + 1 < nn->count && nn->ws[i].cols > width) width = nn->ws[i].cols;
+        size_t p = mat_gemm_scratch(batch, nn->ws[i].cols, nn->ws[i].rows);
+        if (p > pack) pack = p;
+    }
+
+    NN_Workspace ws;
+    ws.batch = batch;
+    float *es = nn_mem_alloc(sizeof(float)*(2*batch*width + pack));
+    NN_ASSERT(es != NULL);
+    ws.act[0] = es;
+    ws.act[1] = es + batch*width;
+    ws.pack = es + 2*batch*width;
+    ws.arena = es;
+    return ws;
+}
+
+inline void nn_workspace_free(NN_Workspace *ws)
+{
+    if (ws->arena) {
+        nn_mem_free(ws->arena);
+    }
+    ws->arena = ws->pack = ws->act[0] = ws->act[1] = NULL;
+    ws->batch = 0;
+}
+
+// Forwards every row of x into y without touching nn: the hidden layers alternate between the
+// workspace buffers and the last layer writes straight into y, which may be a strided view.
+// Inputs longer than the workspace batch are processed in slices.
+inline void nn_infer(const NN *nn, NN_Workspace ws, Mat x, Mat y)
+{
+    NN_ASSERT(x.cols == nn->ws[0].rows);
+    NN_ASSERT(y.cols == nn->ws[nn->count - 1].cols);
+    NN_ASSERT(x.rows == y.rows);
+
+    for (size_t r0 = 0; r0 < x.rows; r0 += ws.batch) {
+        size_t r = x.rows - r0 < ws.batch ? x.rows - r0 : ws.batch;
+        Mat in = mat_rows(x, r0, r);
+        for (size_t i = 0; i < nn->count; ++i) {
+            size_t cols = nn->ws[i].cols;
+            Mat out = i + 1 < nn->count
+                ? (Mat){ .rows = r, .cols = cols, .stride = cols, .es = ws.act[i % 2] }
+                : mat_rows(y, r0, r);
+            mat_dense_scratch(out, in, nn->ws[i], nn->bs[i], nn->acts[i], ws.pack);
+            in = out;
+        }
+    }
+}
+
+inline NN_Q8 nn_quantize(NN nn)
+{
+    size_t ws_count = 0, bs_count = 0;
+    for (size_t i = 0; i < nn.count; ++i) {
+        ws_count += nn.ws[i].rows*nn.ws[i].cols;
+        bs_count += nn.bs[i].cols;
+    }
+
+    NN_Q8 q;
+    q.count = nn.count;
+    char *arena = nn_mem_alloc((sizeof(MatQ8) + sizeof(Mat) + sizeof(NN_Act))*nn.count
+                            + sizeof(float)*bs_count + ws_count);
+    NN_ASSERT(arena != NULL);
+    q.ws = (MatQ8*)arena;
+    q.bs = (Mat*)(q.ws + nn.count);
+    q.arena = arena;
+
+    float *b = (float*)(q.bs + nn.count);
+    q.acts = (NN_Act*)(b + bs_count);
+    memcpy(q.acts, nn.acts, sizeof(*q.acts)*nn.count);
+    int8_t *w = (int8_t*)(q.acts + nn.count);
+    for (size_t i = 0; i < nn.count; ++i) {
+        Mat src = nn.ws[i];
+        float wmax = 0;
+        for (size_t r = 0; r < src.rows; ++r) {
+            for (size_t c = 0; c < src.cols; ++c) wmax = fmaxf(wmax, fabsf(MAT_AT(src, r, c)));
+        }
+        float scale = wmax > 0 ? wmax/127.f : 1.f;
+        q.ws[i] = (MatQ8){ .rows = src.rows, .cols = src.cols, .scale = scale, .es = w };
+        for (size_t r = 0; r < src.rows; ++r) {
+            for (size_t c = 0; c < src.cols; ++c) {
+                *w++ = (int8_t)lrintf(MAT_AT(src, r, c)/scale);
+            }
+        }
+
+        q.bs[i] = (Mat){ .rows = 1, .cols = nn.bs[i].cols, .stride = nn.bs[i].cols, .es = b };
+        mat_copy(q.bs[i], nn.bs[i]);
+        b += nn.bs[i].cols;
+    }
+    return q;
+}
+
+inline void nn_q8_free(NN_Q8 *q)
+{
+    if (q->arena) {
+        nn_mem_free(q->arena);
+    }
+    q->arena = NULL;
+    q->ws = NULL;
+    q->bs = NULL;
+    q->acts = NULL;
+    q->count = 0;
+}
+
+// Besides the activations the q8 path only needs one quantized input row and one row of
+// int32 accumulators, which take the place of the GEMM packing space.
+inline NN_Workspace nn_q8_workspace_alloc(const NN_Q8 *q, size_t batch)
+{
+    NN_ASSERT(batch > 0);
+    size_t width = 0, rows = 0, cols = 0;
+    for (size_t i = 0; i < q->count; ++i) {
+        if (i + 1 < q->count && q->ws[i].cols > width) width = q->ws[i].cols;
+        if (q->ws[i].rows > rows) rows = q->ws[i].rows;
+        if (q->ws[i].cols > cols) cols = q->ws[i].cols;
+    }
+    size_t pack = cols + (rows + sizeof(float) - 1)/sizeof(float);
+
+    NN_Workspace ws;
+    ws.batch = batch;
+    float *es = nn_mem_alloc(sizeof(float)*(2*batch*width + pack));
+    NN_ASSERT(es != NULL);
+    ws.act[0] = es;
+    ws.act[1] = es + batch*width;
+    ws.pack = es + 2*batch*width;
+    ws.arena = es;
+    return ws;
+}
+
+// out = act(x*w + b) with x quantized row by row: y = (sum qx*qw)*sx*sw + b
+static inline void nn_q8_dense(Mat out, Mat x, MatQ8 w, Mat b, NN_Act act, int32_t *acc, int8_t *qx)
+{
+    for (size_t i = 0; i < x.rows; ++i) {
+        const float *xr = &MAT_AT(x, i, 0);
+        float xmax = 0;
+        for (size_t k = 0; k < w.rows; ++k) xmax = fmaxf(xmax, fabsf(xr[k]));
+        float sx = xmax > 0 ? xmax/127.f : 1.f;
+        float inv = 1.f/sx;
+        for (size_t k = 0; k < w.rows; ++k) {
+            float v = xr[k]*inv;
+            qx[k] = (int8_t)(v + (v < 0 ? -0.5f : 0.5f));
+        }
+
+        memset(acc, 0, sizeof(*acc)*w.cols);
+        for (size_t k = 0; k < w.rows; ++k) {
+            int32_t v = qx[k];
+            const int8_t *wr = w.es + k*w.cols;
+            for (size_t j = 0; j < w.cols; ++j) acc[j] += v*wr[j];
+        }
+
+        float s = sx*w.scale;
+        float *y = &MAT_AT(out, i, 0);
+        for (size_t j = 0; j < w.cols; ++j) y[j] = (float)acc[j]*s + b.es[j];
+        nn_span_act(y, w.cols, act);
+    }
+}
+
+inline void nn_q8_infer(const NN_Q8 *q, NN_Workspace ws, Mat x, Mat y)
+{
+    NN_ASSERT(x.cols == q->ws[0].rows);
+    NN_ASSERT(y.cols == q->ws[q->count - 1].cols);
+    NN_ASSERT(x.rows == y.rows);
+
+    size_t cols = 0;
+    for (size_t i = 0; i < q->count; ++i) {
+        if (q->ws[i].cols > cols) cols = q->ws[i].cols;
+    }
+    int32_t *acc = (int32_t*)ws.pack;
+    int8_t *qx = (int8_t*)(ws.pack + cols);
+
+    for (size_t r0 = 0; r0 < x.rows; r0 += ws.batch) {
+        size_t r = x.rows - r0 < ws.batch ? x.rows - r0 : ws.batch;
+        Mat in = mat_rows(x, r0, r);
+        for (size_t i = 0; i < q->count; ++i) {
+            size_t c = q->ws[i].cols;
+            Mat out = i + 1 < q->count
+                ? (Mat){ .rows = r, .cols = c, .stride = c, .es = ws.act[i % 2] }
+                : mat_rows(y, r0, r);
+            nn_q8_dense(out, in, q->ws[i], q->bs[i], q->acts[i], acc, qx);
+            in = out;
+        }
+    }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NN_HAVE_MMAP 1
+#endif
+
+#define NN_CKPT_MAGIC "NNCKPT\0\0"
+#define NN_CKPT_VERSION 2u
+#define NN_CKPT_ENDIAN 0x01020304u
+#define NN_CKPT_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t layers;
+    uint64_t ps_count;
+} NN_CkptHeader;
+
+typedef struct {
+    uint64_t rows, cols, stride, offset;
+} NN_CkptMat;
+
+static inline size_t nn_ckpt_data_offset(size_t layers, uint32_t version)
+{
+    size_t n = sizeof(NN_CkptHeader) + sizeof(uint64_t)*(layers + 1) + sizeof(NN_CkptMat)*2*layers;
+    if (version >= 2) n += sizeof(uint32_t)*layers;
+    return (n + NN_CKPT_ALIGN - 1)/NN_CKPT_ALIGN*NN_CKPT_ALIGN;
+}
+
+inline int nn_save(NN nn, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "nn_save: could not open %s\n", path);
+        return -1;
+    }
+
+    NN_CkptHeader h = { .version = NN_CKPT_VERSION, .endian = NN_CKPT_ENDIAN,
+                        .layers = nn.count, .ps_count = nn.ps_count };
+    memcpy(h.magic, NN_CKPT_MAGIC, sizeof(h.magic));
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    uint64_t dim = NN_INPUT(nn).cols;
+    ok = ok && fwrite(&dim, sizeof(dim), 1, f) == 1;
+    for (size_t i = 0; i < nn.count; ++i) {
+        dim = nn.ws[i].cols;
+        ok = ok && fwrite(&dim, sizeof(dim), 1, f) == 1;
+    }
+
+    size_t data = nn_ckpt_data_offset(nn.count, NN_CKPT_VERSION);
+    uint64_t offset = data;
+    for (size_t i = 0; i < 2*nn.count; ++i) {
+        Mat m = i % 2 ? nn.bs[i/2] : nn.ws[i/2];
+        NN_CkptMat r = { .rows = m.rows, .cols = m.cols, .stride = m.cols, .offset = offset };
+        ok = ok && fwrite(&r, sizeof(r), 1, f) == 1;
+        offset += sizeof(float)*m.rows*m.cols;
+    }
+    for (size_t i = 0; i < nn.count; ++i) {
+        uint32_t act = (uint32_t)nn.acts[i];
+        ok = ok && fwrite(&act, sizeof(act), 1, f) == 1;
+    }
+
+    static const char zeros[NN_CKPT_ALIGN] = {0};
+    long pos = ftell(f);
+    ok = ok && pos >= 0 && fwrite(zeros, 1, data - (size_t)pos, f) == data - (size_t)pos;
+    ok = ok && fwrite(nn.ps, sizeof(float), nn.ps_count, f) == nn.ps_count;
+
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "nn_save: could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+inline void nn_unmap(NN_Map *map)
+{
+    if (map->addr) {
+#ifdef NN_HAVE_MMAP
+        munmap(map->addr, map->size);
+#else
+        nn_mem_free(map->addr);
+#endif
+    }
+    map->addr = NULL;
+    map->size = 0;
+}
+
+// Validates the header, Mat table and activations against the file size before anything
+// points into it
+static inline int nn_ckpt_check(const char *base, size_t size, size_t **arch)
+{
+    if (size < sizeof(NN_CkptHeader)) return 0;
+    const NN_CkptHeader *h = (const NN_CkptHeader*)base;
+    if (memcmp(h->magic, NN_CKPT_MAGIC, sizeof(h->magic)) != 0) return 0;
+    if (h->version < 1 || h->version > NN_CKPT_VERSION || h->endian != NN_CKPT_ENDIAN) return 0;
+    if (h->layers == 0 || h->layers > (1u << 20)) return 0;
+
+    size_t layers = h->layers;
+    size_t data = nn_ckpt_data_offset(layers, h->version);
+    if (size < data) return 0;
+
+    const uint64_t *dims = (const uint64_t*)(h + 1);
+    const NN_CkptMat *ms = (const NN_CkptMat*)(dims + layers + 1);
+    uint64_t offset = data, ps_count = 0;
+    for (size_t i = 0; i < 2*layers; ++i) {
+        uint64_t rows = i % 2 ? 1 : dims[i/2], cols = dims[i/2 + 1];
+        if (ms[i].rows != rows || ms[i].cols != cols || ms[i].stride != cols) return 0;
+        if (ms[i].offset != offset) return 0;
+        // Bounded by what is left of the file before multiplying, so nothing can wrap
+        if (rows == 0 || cols == 0 || offset > size) return 0;
+        if (rows > (size - offset)/sizeof(float)/cols) return 0;
+        offset += sizeof(float)*rows*cols;
+        ps_count += rows*cols;
+    }
+    if (ps_count != h->ps_count || offset > size) return 0;
+    const uint32_t *acts = (const uint32_t*)(ms + 2*layers);
+    for (size_t i = 0; h->version >= 2 && i < layers; ++i) {
+        if (acts[i] >= NN_ACT_COUNT) return 0;
+    }
+
+    *arch = nn_mem_alloc(sizeof(**arch)*(layers + 1));
+    NN_ASSERT(*arch != NULL);
+    for (size_t i = 0; i <= layers; ++i) {
+        (*arch)[i] = dims[i];
+    }
+    return 1;
+}
+
+inline int nn_load(const char *path, size_t batch, NN *nn, NN_Map *map)
+{
+    map->addr = NULL;
+    map->size = 0;
+
+#ifdef NN_HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "nn_load: could not open %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        fprintf(stderr, "nn_load: could not stat %s\n", path);
+        return -1;
+    }
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "nn_load: could not map %s\n", path);
+        return -1;
+    }
+    map->addr = addr;
+    map->size = (size_t)st.st_size;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "nn_load: could not open %s\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    map->addr = size > 0 ? nn_mem_alloc((size_t)size) : NULL;
+    map->size = size > 0 ? (size_t)size : 0;
+    if (!map->addr || fread(map->addr, 1, map->size, f) != map->size) {
+        fclose(f);
+        nn_unmap(map);
+        fprintf(stderr, "nn_load: could not read %s\n", path);
+        return -1;
+    }
+    fclose(f);
+#endif
+
+    size_t *arch = NULL;
+    if (!nn_ckpt_check(map->addr, map->size, &arch)) {
+        nn_unmap(map);
+        fprintf(stderr, "nn_load: %s is not a valid checkpoint\n", path);
+        return -1;
+    }
+
+    const NN_CkptHeader *h = map->addr;
+    size_t layers = h->layers;
+    float *ps = (float*)((char*)map->addr + nn_ckpt_data_offset(layers, h->version));
+    *nn = nn_alloc_layout(arch, layers + 1, batch, ps);
+    if (h->version >= 2) {
+        const uint32_t *acts = (const uint32_t*)((const char*)(h + 1) + sizeof(uint64_t)*(layers + 1)
+                                                 + sizeof(NN_CkptMat)*2*layers);
+        for (size_t i = 0; i < layers; ++i) {
+            nn->acts[i] = (NN_Act)acts[i];
+        }
+    }
+    nn_mem_free(arch);
+    return 0;
+}
+
+#include <pthread.h>
+#include <sched.h>
+
+struct NN_Pool {
+    size_t count;
+    pthread_t *threads;
+    struct NN_PoolSlot { NN_Pool *pool; size_t tid; } *slots;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    size_t pending;
+    NN_Task task;
+    void *ctx;
+    int quit;
+};
+
+static void *nn_pool_worker(void *arg)
+{
+    struct NN_PoolSlot *slot = arg;
+    NN_Pool *pool = slot->pool;
+    size_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        seen = pool->generation;
+        NN_Task task = pool->task;
+        void *ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->mutex);
+
+        task(ctx, slot->tid, pool->count);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+inline NN_Pool *nn_pool_create(size_t count)
+{
+    NN_ASSERT(count > 0);
+    NN_Pool *pool = nn_mem_alloc(sizeof(*pool));
+    NN_ASSERT(pool != NULL);
+    pool->count = count;
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->task = NULL;
+    pool->ctx = NULL;
+    pool->quit = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->threads = nn_mem_alloc(sizeof(*pool->threads)*count);
+    NN_ASSERT(pool->threads != NULL);
+    pool->slots = nn_mem_alloc(sizeof(*pool->slots)*count);
+    NN_ASSERT(pool->slots != NULL);
+    for (size_t i = 1; i < count; ++i) {
+        pool->slots[i].pool = pool;
+        pool->slots[i].tid = i;
+        int err = pthread_create(&pool->threads[i], NULL, nn_pool_worker, &pool->slots[i]);
+        NN_ASSERT(err == 0);
+        (void) err;
+    }
+    return pool;
+}
+
+inline void nn_pool_free(NN_Pool *pool)
+{
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 1; i < pool->count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->mutex);
+    nn_mem_free(pool->slots);
+    nn_mem_free(pool->threads);
+    nn_mem_free(pool);
+}
+
+inline size_t nn_pool_count(const NN_Pool *pool)
+{
+    return pool->count;
+}
+
+inline void nn_pool_run(NN_Pool *pool, NN_Task task, void *ctx)
+{
+    if (pool->count > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->task = task;
+        pool->ctx = ctx;
+        pool->pending = pool->count - 1;
+        pool->generation += 1;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    task(ctx, 0, pool->count);
+
+    if (pool->count > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->pending > 0) {
+            pthread_cond_wait(&pool->done, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+inline NN_Workers nn_workers_alloc(NN_Pool *pool, NN nn)
+{
+    NN_Workers w;
+    size_t count = nn_pool_count(pool);
+    size_t grads = count > NN_SHARDS ? count : NN_SHARDS;
+    w.pool = pool;
+    w.shards = NN_SHARDS;
+    w.ms = nn_mem_alloc(sizeof(*w.ms)*count);
+    NN_ASSERT(w.ms != NULL);
+    w.gs = nn_mem_alloc(sizeof(*w.gs)*grads);
+    NN_ASSERT(w.gs != NULL);
+    w.costs = nn_mem_alloc(sizeof(*w.costs)*w.shards);
+    NN_ASSERT(w.costs != NULL);
+    for (size_t t = 0; t < count; ++t) {
+        w.ms[t] = nn_alloc_shape(nn, NN_INPUT(nn).rows, nn.ps); // activations and scratch only
+    }
+    for (size_t t = 0; t < grads; ++t) {
+        w.gs[t] = nn_alloc_grad(nn);
+    }
+    return w;
+}
+
+inline void nn_workers_free(NN_Workers *w)
+{
+    if (w->ms) {
+        size_t count = nn_pool_count(w->pool);
+        size_t grads = count > w->shards ? count : w->shards;
+        for (size_t t = 0; t < count; ++t) {
+            nn_free(&w->ms[t]);
+        }
+        for (size_t t = 0; t < grads; ++t) {
+            nn_free(&w->gs[t]);
+        }
+        nn_mem_free(w->ms);
+        nn_mem_free(w->gs);
+        nn_mem_free(w->costs);
+    }
+    w->ms = w->gs = NULL;
+    w->costs = NULL;
+}
+
+typedef struct {
+    NN_Workers w;
+    NN nn;
+    Mat ti, to;
+    float *costs;  // per shard, per worker for nn_hogwild
+    size_t stride; // reduction step of the current tree level
+    float rate;    // nn_hogwild only
+    size_t steps;
+    size_t *rows;  // rows behind costs[tid], nn_hogwild only
+} NN_ParallelJob;
+
+// Rows [lo, hi) of part i of count
+static inline void nn_parallel_rows(NN_ParallelJob *job, size_t i, size_t count, size_t *lo, size_t *hi)
+{
+    size_t n = job->ti.rows;
+    *lo = i*n/count;
+    *hi = (i + 1)*n/count;
+}
+
+// Replica of worker tid, rebound to the parameters of job->nn
+static inline NN nn_parallel_bind(NN_ParallelJob *job, size_t tid)
+{
+    NN m = job->w.ms[tid];
+    for (size_t i = 0; i < m.count; ++i) {
+        m.ws[i].es = job->nn.ws[i].es;
+        m.bs[i].es = job->nn.bs[i].es;
+        m.acts[i] = job->nn.acts[i];
+    }
+    m.ps = job->nn.ps;
+    job->w.ms[tid].ps = m.ps;
+    return m;
+}
+
+static void nn_cost_task(void *ctx, size_t tid, size_t count)
+{
+    NN_ParallelJob *job = ctx;
+    NN m = nn_parallel_bind(job, tid);
+    for (size_t i = tid; i < job->w.shards; i += count) {
+        size_t lo, hi;
+        nn_parallel_rows(job, i, job->w.shards, &lo, &hi);
+        job->costs[i] = hi > lo ? nn_cost_sum(m, mat_rows(job->ti, lo, hi - lo), mat_rows(job->to, lo, hi - lo)) : 0.f;
+    }
+}
+
+// Shard gradients are scaled by 2/N already, so that they add up to the gradient of the mean
+static void nn_backprop_task(void *ctx, size_t tid, size_t count)
+{
+    NN_ParallelJob *job = ctx;
+    NN m = nn_parallel_bind(job, tid);
+    float scale = 2.f/(float)job->ti.rows;
+    for (size_t i = tid; i < job->w.shards; i += count) {
+        size_t lo, hi;
+        nn_parallel_rows(job, i, job->w.shards, &lo, &hi);
+        NN g = job->w.gs[i];
+        if (hi > lo) {
+            job->costs[i] = nn_backprop_sum(m, g, mat_rows(job->ti, lo, hi - lo), mat_rows(job->to, lo, hi - lo), scale);
+        } else {
+            job->costs[i] = 0;
+            nn_span_fill(g.ps, g.ps_count, 0);
+        }
+    }
+}
+
+// One level of the tree: shard t (t % 2s == 0) adds shard t + s
+static void nn_reduce_task(void *ctx, size_t tid, size_t count)
+{
+    NN_ParallelJob *job = ctx;
+    size_t s = job->stride;
+    for (size_t t = 2*s*tid; t + s < job->w.shards; t += 2*s*count) {
+        nn_span_add(job->w.gs[t].ps, job->w.gs[t + s].ps, job->w.gs[t].ps_count);
+    }
+}
+
+inline float nn_cost_parallel(NN_Workers w, NN nn, Mat ti, Mat to)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    if (ti.rows == 0) return 0.f;
+    NN_ParallelJob job = { .w = w, .nn = nn, .ti = ti, .to = to, .costs = w.costs };
+    nn_pool_run(w.pool, nn_cost_task, &job);
+    return nn_sum(w.costs, w.shards)/(float)ti.rows;
+}
+
+inline float nn_backprop_parallel(NN_Workers w, NN nn, NN g, Mat ti, Mat to)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(g.ps_count == nn.ps_count);
+    if (ti.rows == 0) {
+        nn_zero(g);
+        return 0.f;
+    }
+    NN_ParallelJob job = { .w = w, .nn = nn, .ti = ti, .to = to, .costs = w.costs };
+    nn_pool_run(w.pool, nn_backprop_task, &job);
+
+    // Pairwise tree over the shards: after the level with stride s, shard t (t % 2s == 0)
+    // holds the sum of shards [t, t + 2s)
+    for (job.stride = 1; job.stride < w.shards; job.stride *= 2) {
+        nn_pool_run(w.pool, nn_reduce_task, &job);
+    }
+    nn_span_copy(g.ps, w.gs[0].ps, g.ps_count);
+    return nn_sum(w.costs, w.shards)/(float)ti.rows;
+}
+
+static void nn_hogwild_task(void *ctx, size_t tid, size_t count)
+{
+    NN_ParallelJob *job = ctx;
+    size_t lo, hi;
+    nn_parallel_rows(job, tid, count, &lo, &hi);
+    NN m = nn_parallel_bind(job, tid), g = job->w.gs[tid];
+    size_t batch = NN_INPUT(m).rows;
+    float *ps = job->nn.ps;
+    job->costs[tid] = 0;
+    job->rows[tid] = 0;
+    if (hi == lo) return;
+
+    size_t i = lo;
+    for (size_t s = 0; s < job->steps; ++s) {
+        size_t r = hi - i < batch ? hi - i : batch;
+        float c = nn_backprop(m, g, mat_rows(job->ti, i, r), mat_rows(job->to, i, r));
+
+        NN_PROF_BEGIN();
+        for (size_t p = 0; p < g.ps_count; ++p) {
+            if (g.ps[p] != 0.f) {
+                float x;
+                __atomic_load(&ps[p], &x, __ATOMIC_RELAXED);
+                x -= job->rate*g.ps[p];
+                __atomic_store(&ps[p], &x, __ATOMIC_RELAXED);
+            }
+        }
+        NN_PROF_END(NN_PROF_LEARN, 2*g.ps_count, 3*sizeof(float)*g.ps_count);
+
+        job->costs[tid] = c*(float)r;
+        job->rows[tid] = r;
+        i = i + r == hi ? lo : i + r;
+    }
+}
+
+inline float nn_hogwild(NN_Workers w, NN nn, Mat ti, Mat to, float rate, size_t steps)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    size_t count = nn_pool_count(w.pool);
+    float *costs = nn_mem_alloc(sizeof(*costs)*count);
+    size_t *rows = nn_mem_alloc(sizeof(*rows)*count);
+    NN_ASSERT(costs != NULL && rows != NULL);
+    NN_ParallelJob job = { .w = w, .nn = nn, .ti = ti, .to = to, .costs = costs,
+                           .rate = rate, .steps = steps, .rows = rows };
+    nn_pool_run(w.pool, nn_hogwild_task, &job);
+
+    float c = 0;
+    size_t n = 0;
+    for (size_t t = 0; t < count; ++t) {
+        c += costs[t];
+        n += rows[t];
+    }
+    nn_mem_free(rows);
+    nn_mem_free(costs);
+    return n ? c/(float)n : 0.f;
+}
+
+inline NN_TrainResult nn_train(NN nn, NN g, Mat ti, Mat to, NN_Train cfg)
+{
+    size_t every = cfg.every ? cfg.every : 1;
+    size_t stale = 0;
+    float ref = INFINITY; // patience reference, moved only by gains of more than min_delta
+    NN_TrainResult res = { .steps = 0, .loss = INFINITY, .best = INFINITY, .reason = NN_STOP_MAX_STEPS };
+
+    while (res.steps < cfg.max_steps) {
+        float loss = cfg.workers ? nn_backprop_parallel(*cfg.workers, nn, g, ti, to)
+                                 : nn_backprop(nn, g, ti, to);
+        if (res.steps % every == 0) {
+            int improved = loss < ref*(1.f - cfg.min_delta);
+            if (improved) ref = loss;
+            res.loss = loss;
+            if (loss < res.best) res.best = loss;
+            if (loss <= cfg.target) {
+                res.reason = NN_STOP_TARGET;
+                break;
+            }
+            stale = improved ? 0 : stale + 1;
+            if (cfg.patience && stale >= cfg.patience) {
+                res.reason = NN_STOP_PATIENCE;
+                break;
+            }
+        }
+        if (cfg.opt) nn_opt_step(cfg.opt, nn, g);
+        else nn_learn(nn, g, cfg.rate);
+        res.steps += 1;
+    }
+    return res;
+}
+
+typedef struct {
+    NN nn, g;
+    Mat ti, to;
+    float eps;
+    float floor;
+    float *errs;
+} NN_GradCheckJob;
+
+// Parameters [lo, hi) of the thread, highest first so every perturbation re-evaluates from its
+// layer over activations that are still those of the unperturbed slice
+static void nn_gradient_check_task(void *ctx, size_t tid, size_t count)
+{
+    NN_GradCheckJob *job = ctx;
+    size_t lo = tid*job->nn.ps_count/count;
+    size_t hi = (tid + 1)*job->nn.ps_count/count;
+    float err = 0;
+
+    if (hi > lo) {
+        NN m = nn_alloc_like(job->nn);
+        nn_span_copy(m.ps, job->nn.ps, m.ps_count);
+        float *fd = nn_mem_alloc(sizeof(*fd)*(hi - lo));
+        NN_ASSERT(fd != NULL);
+        nn_span_fill(fd, hi - lo, 0);
+
+        size_t n = job->ti.rows, batch = NN_INPUT(m).rows;
+        NN_ASSERT(batch > 0);
+        for (size_t s = 0; s < n; s += batch) {
+            size_t r = n - s < batch ? n - s : batch;
+            Mat x = mat_rows(job->ti, s, r), t = mat_rows(job->to, s, r);
+            nn_forward_batch(m, x);
+            for (size_t i = hi; i-- > lo;) {
+                size_t l = nn_param_layer(m, i);
+                float cp = nn_slice_cost_perturbed(m, x, t, l, &m.ps[i], job->eps);
+                float cm = nn_slice_cost_perturbed(m, x, t, l, &m.ps[i], -job->eps);
+                fd[i - lo] += cp - cm;
+            }
+        }
+
+        for (size_t i = lo; i < hi; ++i) {
+            float d = n ? fd[i - lo]/(2*job->eps*(float)n) : 0.f;
+            float an = job->g.ps[i];
+            float scale = fmaxf(fmaxf(fabsf(d), fabsf(an)), job->floor);
+            float e = fabsf(d - an)/scale;
+            if (e > err) err = e;
+        }
+
+        nn_mem_free(fd);
+        nn_free(&m);
+    }
+    job->errs[tid] = err;
+}
+
+inline float nn_gradient_check(NN_Pool *pool, NN nn, NN g, Mat ti, Mat to, float eps)
+{
+    NN_ASSERT(nn.ps_count == g.ps_count);
+    size_t count = nn_pool_count(pool);
+    float *errs = nn_mem_alloc(sizeof(*errs)*count);
+    NN_ASSERT(errs != NULL);
+
+    float gmax = 0;
+    for (size_t i = 0; i < g.ps_count; ++i) {
+        gmax = fmaxf(gmax, fabsf(g.ps[i]));
+    }
+
+    NN_GradCheckJob job = {
+        .nn = nn, .g = g, .ti = ti, .to = to,
+        .eps = eps, .floor = fmaxf(1e-3f*gmax, 1e-12f), .errs = errs,
+    };
+    nn_pool_run(pool, nn_gradient_check_task, &job);
+
+    float err = 0;
+    for (size_t t = 0; t < count; ++t) {
+        if (errs[t] > err) err = errs[t];
+    }
+    nn_mem_free(errs);
+    return err;
+}
+
+inline NN_Pop nn_pop_alloc(size_t *arch, size_t arch_count, size_t models)
+{
+    NN_ASSERT(arch_count > 1);
+    NN_ASSERT(models > 0);
+
+    NN_Pop pop;
+    pop.count = arch_count - 1;
+    pop.models = models;
+    pop.lanes = (models + NN_SIMD_W - 1)/NN_SIMD_W*NN_SIMD_W;
+    pop.ps_count = 0;
+    for (size_t i = 1; i < arch_count; ++i) {
+        pop.ps_count += arch[i-1]*arch[i] + arch[i];
+    }
+
+    size_t head = (sizeof(size_t)*arch_count + sizeof(NN_Act)*pop.count + NN_ALIGN - 1)/NN_ALIGN*NN_ALIGN;
+    char *arena = nn_mem_alloc(head + sizeof(float)*(pop.ps_count + 1)*pop.lanes);
+    NN_ASSERT(arena != NULL);
+
+    pop.arch = (size_t*)arena;
+    pop.acts = (NN_Act*)(pop.arch + arch_count);
+    pop.ps = (float*)(arena + head);
+    pop.rates = pop.ps + pop.ps_count*pop.lanes;
+    pop.arena = arena;
+
+    memcpy(pop.arch, arch, sizeof(size_t)*arch_count);
+    for (size_t i = 0; i < pop.count; ++i) {
+        pop.acts[i] = NN_ACT_SIG;
+    }
+    memset(pop.ps, 0, sizeof(float)*pop.ps_count*pop.lanes);
+    for (size_t k = 0; k < pop.lanes; ++k) {
+        pop.rates[k] = 1e-1f;
+    }
+    return pop;
+}
+
+inline void nn_pop_free(NN_Pop *pop)
+{
+    if (pop->arena) {
+        nn_mem_free(pop->arena);
+    }
+    pop->arena = NULL;
+    pop->arch = NULL;
+    pop->acts = NULL;
+    pop->ps = pop->rates = NULL;
+    pop->count = pop->models = pop->lanes = pop->ps_count = 0;
+}
+
+inline void nn_pop_set(NN_Pop pop, size_t k, NN nn)
+{
+    NN_ASSERT(k < pop.lanes);
+    NN_ASSERT(nn.ps_count == pop.ps_count);
+    for (size_t p = 0; p < pop.ps_count; ++p) {
+        pop.ps[p*pop.lanes + k] = nn.ps[p];
+    }
+}
+
+inline void nn_pop_get(NN_Pop pop, size_t k, NN nn)
+{
+    NN_ASSERT(k < pop.lanes);
+    NN_ASSERT(nn.ps_count == pop.ps_count && nn.count == pop.count);
+    for (size_t p = 0; p < pop.ps_count; ++p) {
+        nn.ps[p] = pop.ps[p*pop.lanes + k];
+    }
+    for (size_t i = 0; i < nn.count; ++i) {
+        nn.acts[i] = pop.acts[i];
+    }
+}
+
+// The padding lanes get models of their own too, so they never compute on NaNs or denormals
+inline void nn_pop_init(NN_Pop pop, uint64_t seed)
+{
+    NN m = nn_alloc(pop.arch, pop.count + 1, 0);
+    for (size_t k = 0; k < pop.lanes; ++k) {
+        NN_Rng rng = nn_rng_seed(seed, k);
+        nn_xavier_init(m, &rng);
+        nn_pop_set(pop, k, m);
+    }
+    nn_free(&m);
+}
+
+typedef struct {
+    NN_Pop pop;
+    Mat ti, to;
+    size_t steps;
+    float *costs; // one per lane
+} NN_PopJob;
+
+// Lanes [lo, hi) of worker tid, in whole SIMD vectors so no two threads write the same one
+static inline void nn_pop_slice(NN_Pop pop, size_t tid, size_t count, size_t *lo, size_t *hi)
+{
+    size_t vecs = pop.lanes/NN_SIMD_W;
+    *lo = tid*vecs/count*NN_SIMD_W;
+    *hi = (tid + 1)*vecs/count*NN_SIMD_W;
+}
+
+// Points as[0..count] (and ds[0..count] when ds is not NULL) into a, unit u of layer l of the
+// w lanes being worked on at as[l] + u*w. Returns the end of what was taken.
+static inline float *nn_pop_layout(NN_Pop pop, float *a, size_t w, float **as, float **ds)
+{
+    for (size_t l = 0; l <= pop.count; ++l) {
+        as[l] = a;
+        a += pop.arch[l]*w;
+        if (ds) {
+            ds[l] = a;
+            a += pop.arch[l]*w;
+        }
+    }
+    return a;
+}
+
+static inline size_t nn_pop_units(NN_Pop pop)
+{
+    size_t units = 0;
+    for (size_t l = 0; l <= pop.count; ++l) {
+        units += pop.arch[l];
+    }
+    return units;
+}
+
+// Row r of ti through lanes [lo, lo + w): every weight and bias is one contiguous run of lanes
+static inline void nn_pop_forward(NN_Pop pop, float **as, size_t lo, size_t w, Mat ti, size_t r)
+{
+    for (size_t u = 0; u < pop.arch[0]; ++u) {
+        nn_span_fill(as[0] + u*w, w, MAT_AT(ti, r, u));
+    }
+    const float *p = pop.ps + lo;
+    for (size_t l = 0; l < pop.count; ++l) {
+        size_t in = pop.arch[l], out = pop.arch[l+1];
+        const float *ws = p, *bs = p + in*out*pop.lanes;
+        for (size_t j = 0; j < out; ++j) {
+            float *z = as[l+1] + j*w;
+            nn_span_copy(z, bs + j*pop.lanes, w);
+            for (size_t i = 0; i < in; ++i) {
+                nn_span_fma(z, as[l] + i*w, ws + (i*out + j)*pop.lanes, w);
+            }
+        }
+        nn_span_act(as[l+1], out*w, pop.acts[l]);
+        p = bs + out*pop.lanes;
+    }
+}
+
+static void nn_pop_train_task(void *ctx, size_t tid, size_t count)
+{
+    NN_PopJob *job = ctx;
+    NN_Pop pop = job->pop;
+    size_t lo, hi;
+    nn_pop_slice(pop, tid, count, &lo, &hi);
+    if (hi == lo) return;
+
+    // The gradient keeps the ps layout with w lanes instead of pop.lanes
+    size_t w = hi - lo, L = pop.lanes;
+    float **as = nn_mem_alloc(2*sizeof(float*)*(pop.count + 1));
+    float *g = nn_mem_alloc(sizeof(float)*(pop.ps_count + 1 + 2*nn_pop_units(pop))*w);
+    NN_ASSERT(as != NULL && g != NULL);
+    float **ds = as + pop.count + 1;
+    float *rate = g + pop.ps_count*w;
+    nn_pop_layout(pop, rate + w, w, as, ds);
+    for (size_t k = 0; k < w; ++k) {
+        rate[k] = -pop.rates[lo + k];
+    }
+
+    size_t n = job->ti.rows, outs = pop.arch[pop.count];
+    for (size_t s = 0; s < job->steps; ++s) {
+        nn_span_fill(g, pop.ps_count*w, 0);
+        for (size_t r = 0; r < n; ++r) {
+            nn_pop_forward(pop, as, lo, w, job->ti, r);
+            for (size_t j = 0; j < outs; ++j) {
+                float t = MAT_AT(job->to, r, j);
+                const float *y = as[pop.count] + j*w;
+                float *d = ds[pop.count] + j*w;
+                for (size_t k = 0; k < w; ++k) {
+                    d[k] = 2.f*(y[k] - t)/(float)n;
+                }
+            }
+
+            size_t off = pop.ps_count;
+            for (size_t l = pop.count; l > 0; --l) {
+                size_t in = pop.arch[l-1], out = pop.arch[l];
+                off -= in*out + out;
+                float *gw = g + off*w, *gb = gw + in*out*w;
+                const float *pw = pop.ps + off*L + lo;
+
+                nn_span_act_grad(ds[l], as[l], out*w, pop.acts[l-1]);
+                nn_span_add(gb, ds[l], out*w);
+                for (size_t i = 0; i < in; ++i) {
+                    for (size_t j = 0; j < out; ++j) {
+                        nn_span_fma(gw + (i*out + j)*w, as[l-1] + i*w, ds[l] + j*w, w);
+                    }
+                }
+
+                if (l > 1) {
+                    for (size_t i = 0; i < in; ++i) {
+                        float *dp = ds[l-1] + i*w;
+                        nn_span_mul(dp, pw + i*out*L, ds[l], w);
+                        for (size_t j = 1; j < out; ++j) {
+                            nn_span_fma(dp, pw + (i*out + j)*L, ds[l] + j*w, w);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t p = 0; p < pop.ps_count; ++p) {
+            nn_span_fma(pop.ps + p*L + lo, rate, g + p*w, w);
+        }
+    }
+
+    nn_mem_free(g);
+    nn_mem_free(as);
+}
+
+static void nn_pop_cost_task(void *ctx, size_t tid, size_t count)
+{
+    NN_PopJob *job = ctx;
+    NN_Pop pop = job->pop;
+    size_t lo, hi;
+    nn_pop_slice(pop, tid, count, &lo, &hi);
+    if (hi == lo) return;
+
+    size_t w = hi - lo;
+    float **as = nn_mem_alloc(sizeof(float*)*(pop.count + 1));
+    float *a = nn_mem_alloc(sizeof(float)*nn_pop_units(pop)*w);
+    NN_ASSERT(as != NULL && a != NULL);
+    nn_pop_layout(pop, a, w, as, NULL);
+
+    float *c = job->costs + lo;
+    nn_span_fill(c, w, 0);
+    size_t n = job->ti.rows;
+    for (size_t r = 0; r < n; ++r) {
+        nn_pop_forward(pop, as, lo, w, job->ti, r);
+        for (size_t j = 0; j < pop.arch[pop.count]; ++j) {
+            float t = MAT_AT(job->to, r, j);
+            const float *y = as[pop.count] + j*w;
+            for (size_t k = 0; k < w; ++k) {
+                c[k] += (y[k] - t)*(y[k] - t);
+            }
+        }
+    }
+    nn_span_scale(c, w, 1.f/(float)n);
+
+    nn_mem_free(a);
+    nn_mem_free(as);
+}
+
+inline void nn_pop_train(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, size_t steps)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(ti.cols == pop.arch[0]);
+    NN_ASSERT(to.cols == pop.arch[pop.count]);
+    for (size_t l = 0; l < pop.count; ++l) {
+        NN_ASSERT(pop.acts[l] != NN_ACT_GELU);
+    }
+    NN_PopJob job = { .pop = pop, .ti = ti, .to = to, .steps = steps };
+    nn_pool_run(pool, nn_pop_train_task, &job);
+}
+
+inline void nn_pop_cost(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, float *costs)
+{
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(ti.cols == pop.arch[0]);
+    NN_ASSERT(to.cols == pop.arch[pop.count]);
+    float *lanes = nn_mem_alloc(sizeof(float)*pop.lanes);
+    NN_ASSERT(lanes != NULL);
+    NN_PopJob job = { .pop = pop, .ti = ti, .to = to, .costs = lanes };
+    nn_pool_run(pool, nn_pop_cost_task, &job);
+    memcpy(costs, lanes, sizeof(float)*pop.models);
+    nn_mem_free(lanes);
+}
+
+// A model that diverged to NaN never wins
+inline size_t nn_pop_best(NN_Pool *pool, NN_Pop pop, Mat ti, Mat to, float *cost)
+{
+    float *costs = nn_mem_alloc(sizeof(float)*pop.models);
+    NN_ASSERT(costs != NULL);
+    nn_pop_cost(pool, pop, ti, to, costs);
+
+    size_t best = 0;
+    for (size_t k = 1; k < pop.models; ++k) {
+        if (costs[k] < costs[best] || isnan(costs[best])) best = k;
+    }
+    if (cost) *cost = costs[best];
+    nn_mem_free(costs);
+    return best;
+}
+
+// Bounded MPMC queue of request pointers (Vyukov): cell i is free for the producer at
+// position pos when seq == pos, and full for the consumer when seq == pos + 1. Producers and
+// consumers only contend on their own position counter, kept on separate cache lines.
+typedef struct {
+    size_t seq;
+    NN_Request *req;
+} NN_ServerCell;
+
+struct NN_Server {
+    _Alignas(NN_ALIGN) size_t head; // next position to enqueue
+    _Alignas(NN_ALIGN) size_t tail; // next position to dequeue
+    _Alignas(NN_ALIGN) NN_ServerCell *cells;
+    size_t mask;
+    const NN *nn;
+    size_t batch;
+    uint64_t deadline_ns;
+    size_t count;
+    pthread_t *threads;
+    int quit;
+};
+
+static inline int nn_server_push(NN_Server *s, NN_Request *req)
+{
+    size_t pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+    for (;;) {
+        NN_ServerCell *c = &s->cells[pos & s->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&s->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                c->req = req;
+                __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            return 0; // the consumer has not freed this cell yet: full
+        } else {
+            pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline int nn_server_pop(NN_Server *s, NN_Request **req)
+{
+    size_t pos = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        NN_ServerCell *c = &s->cells[pos & s->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&s->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *req = c->req;
+                __atomic_store_n(&c->seq, pos + s->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+            return 0; // empty
+        } else {
+            pos = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// An idle worker yields for a while, then sleeps in short naps so an empty server costs no CPU
+static inline void nn_server_idle(size_t *idle)
+{
+    if (++*idle < 64) {
+        sched_yield();
+    } else {
+        struct timespec t = { .tv_sec = 0, .tv_nsec = 20*1000 };
+        nanosleep(&t, NULL);
+    }
+}
+
+static void *nn_server_worker(void *arg)
+{
+    NN_Server *s = arg;
+    const NN *nn = s->nn;
+    size_t in = nn->ws[0].rows, out = nn->ws[nn->count - 1].cols;
+    NN_Workspace ws = nn_workspace_alloc(nn, s->batch);
+    Mat x = mat_alloc(s->batch, in);
+    Mat y = mat_alloc(s->batch, out);
+    NN_Request **reqs = nn_mem_alloc(sizeof(*reqs)*s->batch);
+    NN_ASSERT(reqs != NULL);
+
+    size_t idle = 0;
+    for (;;) {
+        if (!nn_server_pop(s, &reqs[0])) {
+            if (__atomic_load_n(&s->quit, __ATOMIC_ACQUIRE)) break;
+            nn_server_idle(&idle);
+            continue;
+        }
+        idle = 0;
+
+        // The deadline runs from the first request, so none waits longer than deadline_ns for
+        // company; under load the batch fills long before that
+        size_t r = 1;
+        uint64_t deadline = nn_clock_ns() + s->deadline_ns;
+        while (r < s->batch) {
+            if (nn_server_pop(s, &reqs[r])) {
+                r += 1;
+            } else if (nn_clock_ns() >= deadline || __atomic_load_n(&s->quit, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+
+        for (size_t k = 0; k < r; ++k) {
+            memcpy(&MAT_AT(x, k, 0), reqs[k]->in, sizeof(float)*in);
+        }
+        nn_infer(nn, ws, mat_rows(x, 0, r), mat_rows(y, 0, r));
+        for (size_t k = 0; k < r; ++k) {
+            memcpy(reqs[k]->out, &MAT_AT(y, k, 0), sizeof(float)*out);
+            __atomic_store_n(&reqs[k]->done, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    nn_mem_free(reqs);
+    mat_free(&y);
+    mat_free(&x);
+    nn_workspace_free(&ws);
+    return NULL;
+}
+
+inline NN_Server *nn_server_create(const NN *nn, size_t threads, size_t batch, size_t queue, uint64_t deadline_ns)
+{
+    NN_ASSERT(threads > 0);
+    NN_ASSERT(batch > 0);
+    size_t cap = 2;
+    while (cap < queue) cap *= 2;
+
+    NN_Server *s = nn_mem_alloc(sizeof(*s));
+    NN_ASSERT(s != NULL);
+    *s = (NN_Server){ .mask = cap - 1, .nn = nn, .batch = batch, .deadline_ns = deadline_ns, .count = threads };
+    s->cells = nn_mem_alloc(sizeof(*s->cells)*cap);
+    s->threads = nn_mem_alloc(sizeof(*s->threads)*threads);
+    NN_ASSERT(s->cells != NULL && s->threads != NULL);
+    for (size_t i = 0; i < cap; ++i) {
+        s->cells[i].seq = i;
+        s->cells[i].req = NULL;
+    }
+
+    for (size_t t = 0; t < threads; ++t) {
+        int err = pthread_create(&s->threads[t], NULL, nn_server_worker, s);
+        NN_ASSERT(err == 0);
+        (void) err;
+    }
+    return s;
+}
+
+inline void nn_server_free(NN_Server *s)
+{
+    if (!s) return;
+    __atomic_store_n(&s->quit, 1, __ATOMIC_RELEASE);
+    for (size_t t = 0; t < s->count; ++t) {
+        pthread_join(s->threads[t], NULL);
+    }
+    nn_mem_free(s->threads);
+    nn_mem_free(s->cells);
+    nn_mem_free(s);
+}
+
+inline int nn_server_submit(NN_Server *s, NN_Request *req)
+{
+    req->done = 0;
+    return nn_server_push(s, req) ? 0 : -1;
+}
+
+inline int nn_request_done(const NN_Request *req)
+{
+    return __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+}
+
+inline void nn_request_wait(const NN_Request *req)
+{
+    size_t idle = 0;
+    while (!nn_request_done(req)) {
+        nn_server_idle(&idle);
+    }
+}
+
+struct NN_Stream {
+    FILE *f;
+    NN_StreamFormat format;
+    size_t cols;
+    size_t batch;
+    float *bufs[2];
+    long rows[2];   // Rows in a full buffer, 0 for end of epoch, -1 for an error
+    int full[2];
+    size_t next;    // Buffer nn_stream_next hands out next
+    int held;       // The caller still reads the other buffer
+    int failed;
+    int quit;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+// Back to the first row, past the CSV header line if there is one
+static inline int nn_stream_rewind(NN_Stream *s)
+{
+    if (fseek(s->f, 0, SEEK_SET) != 0) return 0;
+    clearerr(s->f);
+    if (s->format == NN_STREAM_CSV) {
+        int c = getc(s->f);
+        if (c != EOF && !strchr("+-.0123456789 \t\r\n", c)) {
+            while (c != EOF && c != '\n') c = getc(s->f);
+        } else if (c != EOF) {
+            ungetc(c, s->f);
+        }
+    }
+    return 1;
+}
+
+static inline long nn_stream_read(NN_Stream *s, float *dst)
+{
+    size_t want = s->batch*s->cols, n = 0;
+    if (s->format == NN_STREAM_F32) {
+        n = fread(dst, sizeof(float), want, s->f);
+        if (ferror(s->f)) return -1;
+    } else {
+        while (n < want) {
+            int c = getc(s->f);
+            while (c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n') c = getc(s->f);
+            if (c == EOF) break;
+            ungetc(c, s->f);
+            if (fscanf(s->f, "%f", &dst[n]) != 1) return -1;
+            n += 1;
+        }
+        if (ferror(s->f)) return -1;
+    }
+    if (n % s->cols != 0) return -1; // Truncated last row
+    return (long)(n/s->cols);
+}
+
+static void *nn_stream_worker(void *arg)
+{
+    NN_Stream *s = arg;
+    size_t i = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&s->mutex);
+        while (s->full[i] && !s->quit) {
+            pthread_cond_wait(&s->cond, &s->mutex);
+        }
+        int quit = s->quit;
+        pthread_mutex_unlock(&s->mutex);
+        if (quit) return NULL;
+
+        long r = nn_stream_read(s, s->bufs[i]);
+        if (r == 0 && !nn_stream_rewind(s)) r = -1;
+
+        pthread_mutex_lock(&s->mutex);
+        s->rows[i] = r;
+        s->full[i] = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        if (r < 0) return NULL; // Nothing sensible to read after an error
+        i ^= 1;
+    }
+}
+
+inline NN_Stream *nn_stream_open(const char *path, NN_StreamFormat format, size_t cols, size_t batch)
+{
+    NN_ASSERT(cols > 0);
+    NN_ASSERT(batch > 0);
+    FILE *f = fopen(path, format == NN_STREAM_CSV ? "r" : "rb");
+    if (!f) {
+        fprintf(stderr, "nn_stream_open: could not open %s\n", path);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20); // Read in large chunks
+
+    NN_Stream *s = nn_mem_alloc(sizeof(*s));
+    NN_ASSERT(s != NULL);
+    *s = (NN_Stream){ .f = f, .format = format, .cols = cols, .batch = batch };
+    s->bufs[0] = nn_mem_alloc(sizeof(float)*2*batch*cols);
+    NN_ASSERT(s->bufs[0] != NULL);
+    s->bufs[1] = s->bufs[0] + batch*cols;
+    if (!nn_stream_rewind(s)) {
+        fprintf(stderr, "nn_stream_open: %s is not seekable\n", path);
+        fclose(f);
+        nn_mem_free(s->bufs[0]);
+        nn_mem_free(s);
+        return NULL;
+    }
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    int err = pthread_create(&s->thread, NULL, nn_stream_worker, s);
+    NN_ASSERT(err == 0);
+    (void) err;
+    return s;
+}
+
+inline long nn_stream_next(NN_Stream *s, Mat *batch)
+{
+    pthread_mutex_lock(&s->mutex);
+    if (s->failed) {
+        pthread_mutex_unlock(&s->mutex);
+        return -1;
+    }
+    if (s->held) {
+        s->full[s->next ^ 1] = 0; // The caller is done with the previous batch
+        pthread_cond_broadcast(&s->cond);
+    }
+    while (!s->full[s->next]) {
+        pthread_cond_wait(&s->cond, &s->mutex);
+    }
+    size_t i = s->next;
+    long r = s->rows[i];
+    s->held = 1;
+    s->next ^= 1;
+    s->failed = r < 0;
+    pthread_mutex_unlock(&s->mutex);
+
+    *batch = (Mat){
+        .rows = r > 0 ? (size_t)r : 0,
+        .cols = s->cols,
+        .stride = s->cols,
+        .es = s->bufs[i]
+    };
+    return r;
+}
+
+inline void nn_stream_close(NN_Stream *s)
+{
+    if (!s) return;
+    pthread_mutex_lock(&s->mutex);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    fclose(s->f);
+    nn_mem_free(s->bufs[0]);
+    nn_mem_free(s);
 }
 
 #endif // NN_IMPLEMENTATION C implementation ends
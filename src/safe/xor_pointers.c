@@ -1,13 +1,5 @@
 #define NN_IMPLEMENTATION
 #include "../neural_net.h"
-#include <mach/mach_time.h>
-
-typedef struct { // Here we can easily add layers into our model
-  Mat a0, a1, a2;
-  Mat w1, b1; // Layer 1
-  Mat w2, b2; // Layer 2
-  int owns_matrices; // Indicates if the struct owns the matrices
-} Xor;
 
 float td[] = {
   0, 0, 0,
@@ -16,148 +8,15 @@ float td[] = {
   1, 1, 0
 };
 
-void xor_alloc(Xor *m)
-{
-  // Initial conditions
-  m->a0 = mat_alloc(1, 2);
-
-  // Layer 1:
-  m->w1 = mat_alloc(2, 2);
-  m->b1 = mat_alloc(1, 2);
-  m->a1 = mat_alloc(1, 2); // Destination matrix
-
-  // Layer 2:
-  m->w2 = mat_alloc(2, 1);
-  m->b2 = mat_alloc(1, 1);
-  m->a2 = mat_alloc(1, 1); // Again, destination matrix
-
-  m->owns_matrices = 1; // Set the flag
-}
-
-// Deallocate memory addresses storing parameters:
-void xor_free(Xor *m)
-{
-  if (m->owns_matrices) {
-    mat_free(&m->a0);
-    mat_free(&m->a1);
-    mat_free(&m->a2);
-    mat_free(&m->w1);
-    mat_free(&m->b1);
-    mat_free(&m->w2);
-    mat_free(&m->b2);
-  }
-  m->owns_matrices = 0; // Restore flag
-}
-
-void forward_xor(const Xor *m)
-{
-  // Passing through layer 1:
-  mat_dot(m->a1, m->a0, m->w1);
-  mat_sum(m->a1, m->b1);
-  mat_sig(m->a1);
-
-  // Passing through layer 2:
-  mat_dot(m->a2, m->a1, m->w2);
-  mat_sum(m->a2, m->b2);
-  mat_sig(m->a2);
-}
-
-float cost(const Xor *m, Mat ti, Mat to) { // training input, training output
-  NN_ASSERT(ti.rows == to.rows);   // Checks if training data was split correctly
-  NN_ASSERT(to.cols == m->a2.cols); // Output from network matches expected output in training data
-  NN_ASSERT(ti.cols == m->a0.cols); // Number of input features matches input layer of network
-  size_t n = ti.rows;
-  float c = 0;
-
-  for (size_t i = 0; i < n; ++i) {
-    Mat x = mat_row(ti, i);
-    Mat y = mat_row(to, i);
-    mat_copy(m->a0, x);
-    forward_xor(m);
-
-    size_t q = to.cols;
-    for (size_t j = 0; j < q; ++j) {
-      float d = MAT_AT(m->a2, 0, j) - MAT_AT(y, 0, j);
-      c += d*d;
-    }
-  }
-  return c/(float)n;
-}
-
-void finite_diff(const Xor *m, const Xor *g, Mat ti, Mat to, float eps)
-{
-  float saved;
-  float c = cost(m, ti, to);
-
-  for (size_t i = 0; i < m->w1.cols; ++i) {
-    for (size_t j = 0; j < m->w1.rows; ++j) {
-      saved = MAT_AT(m->w1, i, j);
-      MAT_AT(m->w1, i, j) += eps;
-      MAT_AT(g->w1, i, j) = (cost(m, ti, to) - c) / eps;
-      MAT_AT(m->w1, i, j) = saved;
-    }
-  }
+int main(int argc, char **argv) {
+  // Optional argument: number of training threads (data-parallel mode when > 1)
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+  if (threads == 0) threads = 1;
+  // Optional second argument: checkpoint file, loaded instead of training when it exists
+  // and written after training otherwise
+  const char *ckpt = argc > 2 ? argv[2] : NULL;
 
-  for (size_t i = 0; i < m->b1.cols; ++i) {
-    for (size_t j = 0; j < m->b1.rows; ++j) {
-      saved = MAT_AT(m->b1, i, j);
-      MAT_AT(m->b1, i, j) += eps;
-      MAT_AT(g->b1, i, j) = (cost(m, ti, to) - c) / eps;
-      MAT_AT(m->b1, i, j) = saved;
-    }
-  }
-
-  for (size_t i = 0; i < m->w2.cols; ++i) {
-    for (size_t j = 0; j < m->w2.rows; ++j) {
-      saved = MAT_AT(m->w2, i, j);
-      MAT_AT(m->w2, i, j) += eps;
-      MAT_AT(g->w2, i, j) = (cost(m, ti, to) - c) / eps;
-      MAT_AT(m->w2, i, j) = saved;
-    }
-  }
-
-  for (size_t i = 0; i < m->b2.cols; ++i) {
-    for (size_t j = 0; j < m->b2.rows; ++j) {
-      saved = MAT_AT(m->b2, i, j);
-      MAT_AT(m->b2, i, j) += eps;
-      MAT_AT(g->b2, i, j) = (cost(m, ti, to) - c) / eps;
-      MAT_AT(m->b2, i, j) = saved;
-    }
-  }
-
-}
-
-void xor_learn(const Xor *m, const Xor *g, float rate)
-{
-  for (size_t i = 0; i < m->w1.cols; ++i) {
-    for (size_t j = 0; j < m->w1.rows; ++j) {
-      MAT_AT(m->w1, i, j) -= rate * MAT_AT(g->w1, i, j);
-    }
-  }
-
-  for (size_t i = 0; i < m->b1.cols; ++i) {
-    for (size_t j = 0; j < m->b1.rows; ++j) {
-      MAT_AT(m->b1, i, j) -= rate * MAT_AT(g->b1, i, j);
-    }
-  }
-
-  for (size_t i = 0; i < m->w2.cols; ++i) {
-    for (size_t j = 0; j < m->w2.rows; ++j) {
-      MAT_AT(m->w2, i, j) -= rate * MAT_AT(g->w2, i, j);
-    }
-  }
-
-  for (size_t i = 0; i < m->b2.cols; ++i) {
-    for (size_t j = 0; j < m->b2.rows; ++j) {
-      MAT_AT(m->b2, i, j) -= rate * MAT_AT(g->b2, i, j);
-    }
-  }
-
-}
-
-int main(void) {
-  uint64_t seed = mach_absolute_time();
-  srand((unsigned int) seed);
+  NN_Rng rng = nn_rng_seed(nn_clock_ns(), 0);
 
   size_t stride = 3;
   size_t n = sizeof(td) / sizeof(td[0])/stride;
@@ -177,45 +36,101 @@ int main(void) {
     .es = td + 2
   };
 
-   Xor *m = NN_MALLOC(sizeof(Xor));
-   xor_alloc(m);
-   Xor *g = NN_MALLOC(sizeof(Xor));
-   xor_alloc(g);
-
-  // Initialise matrices (Xavier initialisation reduced variance when training):
-  mat_xavier_init(m->w1, m->a0.cols, m->a1.cols); //mat_rand(m->w1, -0.5, 0.5);
-  mat_rand(m->b1, -0.5f, 0.5f);
-  mat_xavier_init(m->w2, m->a1.cols, m->a2.cols); //mat_rand(m->w2, -0.5, 0.5);
-  mat_rand(m->b2, -0.5f, 0.5f);
-
-
-  printf("cost: %f\n", cost(m, ti, to));   // Compute and print old cost
-  for (size_t i = 0; i < 100*1000; ++i) {
-    float eps = 1e-1f;
-    float rate = 1e-1f;
-    finite_diff(m, g, ti, to, eps);        // Compute finite difference ("grad")
-    xor_learn(m, g, rate);                 // Apply gradient
-    cost(m, ti, to);                       // Compute new cost
+  size_t arch[] = {2, 2, 1}; // Here we can easily add layers into our model
+  NN *m = NN_MALLOC(sizeof(NN));
+  NN_Map map = {0};
+  int loaded = ckpt && nn_load(ckpt, n, m, &map) == 0; // Parameters mapped from the file
+  // A valid checkpoint of another architecture cannot be trained on this data
+  if (loaded && (m->count != ARRAY_LEN(arch) - 1 || NN_INPUT(*m).cols != arch[0] ||
+                 m->ws[0].cols != arch[1] || m->ws[1].cols != arch[2])) {
+    fprintf(stderr, "%s: not a {2, 2, 1} model, training a new one instead\n", ckpt);
+    nn_free(m);
+    nn_unmap(&map);
+    loaded = 0;
   }
-  printf("cost: %f\n", cost(m, ti, to));   // Compute and print final cost
+  if (!loaded) {
+    *m = nn_alloc(arch, ARRAY_LEN(arch), n); // One batch holds the whole training set
+    // Initialise matrices (Xavier initialisation reduced variance when training):
+    nn_xavier_init(*m, &rng);
+  }
+  NN *g = NN_MALLOC(sizeof(NN));
+  *g = nn_alloc_grad(*m); // Parameters only, no activations
+
+  NN_Pool *pool = nn_pool_create(threads);
+  NN_Workers w = nn_workers_alloc(pool, *m); // Per-thread replicas and gradients
+
+  // Check backpropagation against finite differences before trusting it for training
+  nn_backprop(*m, *g, ti, to);
+  printf("gradient check: max rel error %e\n", nn_gradient_check(pool, *m, *g, ti, to, 1e-2f));
+
+  // Nesterov momentum gets to the cost plain SGD reaches in 100k steps in a tenth of them
+  NN_Opt opt = nn_opt_alloc(*m, NN_OPT_NESTEROV, 1e-1f);
+
+  // Stop as soon as the cost, which comes with every gradient, is below 1e-3, or once it has
+  // stalled for 20 checks (a local minimum), instead of always running the whole budget
+  NN_Train train = {
+    .max_steps = loaded ? 0 : 10*1000,
+    .every = 100,
+    .target = 1e-3f,
+    .patience = 20,
+    .min_delta = 1e-3f,
+    .opt = &opt,
+    .workers = threads > 1 ? &w : NULL, // Rows split across the pool, gradients reduced
+  };
+  static const char *why[] = { "converged", "stalled", "step budget used" };
+
+  printf("cost: %f\n", nn_cost(*m, ti, to));   // Compute and print old cost
+  NN_TrainResult res = nn_train(*m, *g, ti, to, train);
+  printf("cost: %f\n", nn_cost(*m, ti, to));   // Compute and print final cost
+  if (!loaded) printf("%s after %zu steps\n", why[res.reason], res.steps);
+  if (ckpt && !loaded && nn_save(*m, ckpt) == 0) printf("saved %s\n", ckpt);
+
+  // Whether the single model above converges depends on its seed. A population of 32 models,
+  // each with its own seed and learning rate, trains in lockstep for about the cost of one
+  NN_Pop pop = nn_pop_alloc(arch, ARRAY_LEN(arch), 32);
+  nn_pop_init(pop, nn_clock_ns());
+  for (size_t k = 0; k < pop.lanes; ++k) pop.rates[k] = 1e-1f*(1.f + (float)(k % 8));
+  nn_pop_train(pool, pop, ti, to, 10*1000);
+  float best_cost;
+  size_t best = nn_pop_best(pool, pop, ti, to, &best_cost);
+  printf("population: best of %zu is %zu (rate %.1f), cost %f\n", pop.models, best, pop.rates[best], best_cost);
+  nn_pop_free(&pop);
 
   printf("---------------------------\n");
 
   // Here we print out XOR's truth table using our network's output as parameters:
-  for (size_t i = 0; i < 2; ++i) {
-    for (size_t j = 0; j < 2; ++j) {
-      MAT_AT(m->a0, 0, 0) = (float)i;
-      MAT_AT(m->a0, 0, 1) = (float)j;
-      forward_xor(m);
-      float y = *m->a2.es;
-      printf("%zu ^ %zu = %f\n", i, j, y);
-    }
+  // Inference only reads the model: the activations live in a caller-owned workspace and the
+  // results land in our own output matrix
+  NN_Workspace ws = nn_workspace_alloc(m, n);
+  Mat out = mat_alloc(n, 1);
+  nn_infer(m, ws, ti, out); // The training inputs are the whole truth table
+  for (size_t i = 0; i < n; ++i) {
+    size_t x = (size_t)MAT_AT(ti, i, 0);
+    size_t y = (size_t)MAT_AT(ti, i, 1);
+    printf("%zu ^ %zu = %f\n", x, y, MAT_AT(out, i, 0));
   }
-  
-  xor_free(m);
-  free(m);
-  xor_free(g);
-  free(g);
+
+  // The same table from the int8 model quantized off the trained one
+  NN_Q8 q = nn_quantize(*m);
+  NN_Workspace qws = nn_q8_workspace_alloc(&q, n);
+  nn_q8_infer(&q, qws, ti, out);
+  printf("int8:");
+  for (size_t i = 0; i < n; ++i) printf(" %f", MAT_AT(out, i, 0));
+  printf("\n");
+  nn_workspace_free(&qws);
+  nn_q8_free(&q);
+
+  mat_free(&out);
+  nn_workspace_free(&ws);
+
+  nn_opt_free(&opt);
+  nn_workers_free(&w);
+  nn_pool_free(pool);
+  nn_free(m);
+  NN_FREE(m);
+  nn_unmap(&map);
+  nn_free(g);
+  NN_FREE(g);
 
   return 0;
 }
@@ -0,0 +1,75 @@
+#define NN_IMPLEMENTATION
+#include "../neural_net.h"
+#include <string.h>
+
+// Trains XOR from a file of (x0, x1, y) rows that is streamed batch by batch instead of
+// being loaded, so the dataset may be larger than memory. Files ending in .csv are parsed as
+// CSV, anything else is read as raw float32 rows.
+//
+// usage: xor_stream <data.csv|data.f32> [epochs] [batch]
+
+float tt[] = { // Truth table for the final check
+  0, 0,
+  0, 1,
+  1, 0,
+  1, 1
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <data.csv|data.f32> [epochs] [batch]\n", argv[0]);
+    return 1;
+  }
+  const char *path = argv[1];
+  size_t epochs = argc > 2 ? strtoul(argv[2], NULL, 10) : 50;
+  size_t batch = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+  if (batch == 0) batch = 1;
+
+  size_t len = strlen(path);
+  NN_StreamFormat format = len > 4 && strcmp(path + len - 4, ".csv") == 0 ? NN_STREAM_CSV : NN_STREAM_F32;
+  NN_Stream *data = nn_stream_open(path, format, 3, batch);
+  if (!data) return 1;
+
+  NN_Rng rng = nn_rng_seed(nn_clock_ns(), 0);
+  size_t arch[] = {2, 4, 1};
+  NN m = nn_alloc(arch, ARRAY_LEN(arch), batch);
+  NN g = nn_alloc_grad(m);
+  nn_xavier_init(m, &rng);
+
+  for (size_t e = 0; e < epochs; ++e) {
+    Mat b;
+    long r;
+    float cost = 0;
+    size_t rows = 0;
+    // The next batch is read in the background while this one trains
+    while ((r = nn_stream_next(data, &b)) > 0) {
+      Mat ti = mat_cols(b, 0, 2); // Features and labels are strided views into the batch
+      Mat to = mat_cols(b, 2, 1);
+      cost += nn_backprop(m, g, ti, to)*(float)b.rows; // Cost of the batch before the step
+      nn_learn(m, g, 1.f);
+      rows += b.rows;
+    }
+    if (r < 0) {
+      fprintf(stderr, "%s: could not read %s\n", argv[0], path);
+      break;
+    }
+    printf("epoch %zu: %zu rows, cost %f\n", e, rows, rows ? cost/(float)rows : 0.f);
+  }
+
+  printf("---------------------------\n");
+
+  Mat ti = { .rows = 4, .cols = 2, .stride = 2, .es = tt };
+  NN_Workspace ws = nn_workspace_alloc(&m, ti.rows);
+  Mat out = mat_alloc(ti.rows, 1);
+  nn_infer(&m, ws, ti, out);
+  for (size_t i = 0; i < ti.rows; ++i) {
+    printf("%zu ^ %zu = %f\n", (size_t)MAT_AT(ti, i, 0), (size_t)MAT_AT(ti, i, 1), MAT_AT(out, i, 0));
+  }
+  mat_free(&out);
+  nn_workspace_free(&ws);
+
+  nn_free(&m);
+  nn_free(&g);
+  nn_stream_close(data);
+  return 0;
+}